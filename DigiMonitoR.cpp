@@ -15,6 +15,10 @@
  */
 
 #define WIN32_LEAN_AND_MEAN
+#define FD_SETSIZE 1024
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
 #include <windows.h>
 #include <windowsx.h>
 #include <setupapi.h>
@@ -23,11 +27,19 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
 #include <Richedit.h>
 #include "resource.h"
 
 #pragma comment(lib, "setupapi.lib")
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "ws2_32.lib")
 #pragma comment(linker, "/manifestdependency:\"type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 
 enum {
@@ -39,8 +51,124 @@ enum {
         DMR_FRAME_TAIL = 0x10,
 };
 
+enum {
+        DMR_ANALYTICS_TALKGROUP = 0,
+        DMR_ANALYTICS_SOURCE,
+        DMR_ANALYTICS_COLOR_CODE,
+        DMR_ANALYTICS_SLOT,
+        DMR_ANALYTICS_PORT,
+        DMR_ANALYTICS_DIMENSIONS,
+};
+
+enum {
+        DMR_EVENT_NONE = 0,
+        DMR_EVENT_CALL_START,
+        DMR_EVENT_CALL_END,
+        DMR_EVENT_DETECTED,
+        DMR_EVENT_ALIAS,
+        DMR_EVENT_GPS,
+        DMR_EVENT_CHANNEL,
+        DMR_EVENT_GROUP_LIST,
+        DMR_EVENT_BUSY,
+};
+
 #define WM_LOG_MESSAGE (WM_APP + 1)
 
+#define SCROLLBACK_LINES        1000000 // Lines kept in the log pane and events in the search index
+#define SCROLLBACK_TRIM         10000
+#define SEARCH_RESULT_LINES     1000
+#define SEARCH_SWEEP_BUCKETS    16 // Posting buckets swept per indexed event
+#define SEARCH_BENCH_EVENTS     1000000
+
+#define ARCHIVE_DATA_FILE       "DigiMonitoR.dma"
+#define ARCHIVE_INDEX_FILE      "DigiMonitoR.dmi"
+#define ARCHIVE_MAGIC           0x42524D44 // "DMRB"
+#define ARCHIVE_INDEX_MAGIC     0x49524D44 // "DMRI"
+#define ARCHIVE_INDEX_VERSION   2
+#define ARCHIVE_FILTER_BITS     4096 // Per block Bloom filter of source and destination IDs
+#define ARCHIVE_BLOCK_EVENTS    4096
+#define ARCHIVE_BLOCK_AGE       (15 * 60 * 1000)
+#define ARCHIVE_QUERY_LINES     1000
+#define ARCHIVE_QUEUE_BLOCKS    16
+#define ARCHIVE_BENCH_DATA_FILE "DigiMonitoR-bench.dma"
+#define ARCHIVE_BENCH_INDEX_FILE "DigiMonitoR-bench.dmi"
+#define ARCHIVE_BENCH_EVENTS    10000000
+
+#define BENCH_EVENT_INTERVAL    50 // Milliseconds between synthetic events
+
+#define SINK_QUEUE_LIMIT        16384
+#define SINK_BATCH_EVENTS       256
+#define SINK_BATCH_INTERVAL     1000
+#define SINK_BATCH_BYTES        (256 * 1024)
+#define SINK_SYNC_INTERVAL      5000
+#define SINK_ROTATE_SIZE        (64ULL * 1024 * 1024)
+#define SINK_ROTATE_TIME        (60ULL * 60 * 1000)
+#define SINK_PREFIX             "DigiMonitoR"
+#define SINK_BENCH_PREFIX       "DigiMonitoR-bench"
+#define SINK_BENCH_EVENTS       1000000
+#define SINK_BENCH_SIZE         (1024 * 1024)
+#define SINK_BENCH_TIME         1000
+
+#define PUBLISH_DEFAULT_PORT    4680
+#define PUBLISH_UNIX_PATH       "DigiMonitoR.sock"
+#define PUBLISH_MAX_SUBSCRIBERS 1000
+#define PUBLISH_INBOX_LIMIT     16384
+#define PUBLISH_QUEUE_LIMIT     4096
+#define PUBLISH_SLOW_TIMEOUT    5000
+#define PUBLISH_REQUEST_TIMEOUT 5000 // Time a new connection has to send its request line
+#define PUBLISH_BENCH_EVENTS    1000000
+#define PUBLISH_SEND_BATCH      65536
+
+#define RING_NAME               "Local\\DigiMonitoR.Events"
+#define RING_MAGIC              0x474E5244 // "DRNG"
+#define RING_VERSION            1
+#define RING_SLOT_COUNT         4096
+#define RING_MUTEX_NAME         "Local\\DigiMonitoR.Events.Writer"
+#define RING_BENCH_READERS      2
+#define RING_BENCH_EVENTS       10000000
+
+#define RECORDER_BYTES          (1024 * 1024)
+#define RECORDER_CHUNKS         16384
+#define RECORDER_PRE_TIME       30000
+#define RECORDER_POST_TIME      10000
+#define RECORDER_HOLDOFF        60000
+#define RECORDER_BURST_COUNT    16
+#define RECORDER_BURST_TIME     1000
+#define RECORDER_MAX_PENDING    4
+
+#define MERGE_REORDER_WINDOW    2000
+
+#define STATE_FILE              "DigiMonitoR.dms"
+#define STATE_TEMP_FILE         "DigiMonitoR.dms.tmp"
+#define STATE_MAGIC             0x53524D44 // "DMRS"
+#define STATE_VERSION           1
+#define STATE_INTERVAL          (5 * 60 * 1000)
+#define STATE_MIN_INDEX         1024
+#define STATE_COPY_SLICE        16384 // Stations copied per hold of the state lock
+#define STATE_CALL_AGE          (3 * 60 * 1000) // Calls older than this are assumed to have ended
+#define STATE_BENCH_FILE        "DigiMonitoR-bench.dms"
+#define STATE_BENCH_TEMP_FILE   "DigiMonitoR-bench.dms.tmp"
+#define STATE_BENCH_STATIONS    1000000
+
+#define PROFILE_MAX_KEYS        256
+#define PROFILE_HISTOGRAM_BYTES 16
+#define PROFILE_SAMPLES         4
+#define PROFILE_TOP_VALUES      4
+#define PROFILE_TIMING_SAMPLE   64 // One frame in this many is timed
+
+#define ANALYTICS_BUCKET_TIME   60000
+#define ANALYTICS_BUCKETS       60 // Sliding window of one hour
+#define ANALYTICS_PERIOD        (60 * 60 * 1000) // Tumbling window, reported as hours
+#define ANALYTICS_SPAN_LIMIT    (2 * ANALYTICS_PERIOD)
+#define ANALYTICS_MAX_KEYS      4096
+#define ANALYTICS_TOP           10
+
+#define RECORDING_MAGIC         0x43524D44 // "DMRC"
+#define RECORDING_VERSION       1
+#define MERGE_BENCH_FILES       100
+#define MERGE_BENCH_CHUNKS      10000 // Per recording, one call start or end each
+#define MERGE_BENCH_PATTERN     "DigiMonitoR-bench-merge-*.dmc"
+
 #pragma pack(push, 1)
 
 typedef struct {
@@ -53,21 +181,461 @@ typedef struct {
         uint8_t Data[];
 } DMR_Frame_t;
 
+// Recordings (.dmc) are a DMR_RecordingHeader_t followed by chunks, each a
+// DMR_RecordingChunk_t and Length bytes of raw serial input.
+typedef struct {
+        uint32_t Magic;
+        uint16_t Version;
+        uint8_t Port;
+        uint8_t Reserved;
+} DMR_RecordingHeader_t;
+
+typedef struct {
+        uint64_t Time;
+        uint32_t Length;
+} DMR_RecordingChunk_t;
+
 #pragma pack(pop)
 
+typedef struct {
+        uint64_t Time; // Capture time in milliseconds since the Unix epoch
+        uint8_t Type;
+        uint8_t Port;
+        uint8_t Command;
+        uint8_t RW;
+        uint8_t CallType;
+        uint8_t ColorCode;
+        uint8_t Slot;
+        uint8_t Busy;
+        uint32_t Source;
+        uint32_t Destination;
+        int32_t Latitude; // Raw 24-bit two's complement value
+        int32_t Longitude; // Raw 25-bit two's complement value
+        uint32_t RxFrequency;
+        uint32_t TxFrequency;
+        uint8_t AliasFormat;
+        uint8_t Count; // Length of Alias or number of Groups
+        char Alias[128];
+        uint32_t Groups[64];
+} DMR_Event_t;
+
+// State file (.dms): a DMR_StateHeader_t, then the stations and the channel, group list and call records
+typedef struct {
+        uint32_t Magic;
+        uint16_t Version;
+        uint16_t HeaderSize;
+        uint64_t Time;
+        uint32_t StationCount;
+        uint32_t EventCount;
+        uint64_t Checksum; // Of everything after the header
+} DMR_StateHeader_t;
+
+typedef struct {
+        uint32_t Id;
+        uint8_t AliasFormat;
+        uint8_t AliasLength;
+        uint8_t bGps;
+        uint8_t Reserved;
+        uint64_t AliasTime; // 0 when no alias has been seen
+        uint64_t GpsTime;
+        int32_t Latitude;
+        int32_t Longitude;
+        char Alias[64];
+} DMR_Station_t;
+
+static_assert(sizeof(DMR_Station_t) % 4 == 0 && sizeof(DMR_Event_t) % 4 == 0, "State file records must be a multiple of 4 bytes");
+
+typedef struct {
+        const char *pFile;
+        const char *pTempFile; // Written first and renamed over pFile
+        std::mutex Mutex;
+        bool bChanged;
+        bool bFullCopy;
+        std::vector<DMR_Station_t> Stations;
+        std::vector<uint32_t> Index; // Open addressing, station index + 1, 0 when empty
+        std::vector<uint32_t> Dirty;
+        std::vector<DMR_Station_t> Shadow; // Saving thread's copy of Stations
+        std::vector<DMR_Event_t> Events;
+} DMR_State_t;
+
+typedef struct {
+        uint64_t Time;
+        uint64_t Position; // Offset of the first byte in the recorder stream
+        uint32_t Length;
+} DMR_Chunk_t;
+
+typedef struct {
+        uint8_t Port;
+        uint64_t Time; // Capture time of the latest read
+        uint64_t Written;
+        uint64_t Chunks;
+        uint64_t TriggerTime; // 0 when no snapshot is pending
+        uint64_t LastTrigger;
+        uint64_t BurstStart;
+        uint32_t BurstCount;
+        char Reason[32];
+        DMR_Chunk_t Chunk[RECORDER_CHUNKS];
+        uint8_t Bytes[RECORDER_BYTES];
+} DMR_Recorder_t;
+
+typedef struct {
+        uint64_t Time;
+        char Reason[32];
+        std::vector<uint8_t> Data;
+} DMR_Snapshot_t;
+
+// Undecoded frames of one command, direction and payload length
+typedef struct {
+        uint8_t Command;
+        uint8_t RW;
+        uint16_t Length;
+        uint64_t Count;
+        uint64_t FirstTime;
+        uint64_t LastTime;
+        uint8_t First[256]; // Payload of the first frame
+        uint8_t Varying[32]; // Bit per payload byte that has differed from First
+        uint8_t Samples;
+        uint8_t Sample[PROFILE_SAMPLES][256];
+        uint32_t Histogram[PROFILE_HISTOGRAM_BYTES][256];
+} DMR_Profile_t;
+
+typedef struct {
+        volatile bool bEnabled;
+        uint64_t Frames;
+        uint64_t Dropped;
+        uint64_t Ticks; // QueryPerformanceCounter ticks spent aggregating the Timed frames
+        uint64_t Timed;
+        uint64_t Dumps; // Frames hex dumped while discovery mode was off
+        uint64_t DumpTicks;
+        std::unordered_map<uint32_t, std::unique_ptr<DMR_Profile_t>> Profiles;
+} DMR_Profiler_t;
+
+// Per stream decoding state, for the live port and for replayed recordings
+typedef struct {
+        uint8_t Port;
+        std::vector<uint8_t> Buffer;
+        DMR_Event_t CurrentCall; // Call that aliases and GPS reports belong to
+        DMR_Recorder_t *pRecorder; // NULL when replaying
+        DMR_Profiler_t *pProfiler; // NULL when replaying
+} DMR_Decoder_t;
+
+typedef struct {
+        std::string Path;
+        uint64_t StartTime; // Time of the first chunk
+} DMR_MergeFile_t;
+
+typedef struct {
+        HANDLE hFile;
+        DMR_Decoder_t Decoder;
+        uint64_t LastTime; // Time of the last chunk read
+} DMR_MergeSource_t;
+
+typedef struct {
+        DMR_Event_t Event;
+        uint64_t Sequence; // Keeps equal timestamps in arrival order
+} DMR_MergeEntry_t;
+
+typedef struct {
+        std::vector<std::unique_ptr<DMR_MergeSource_t>> Sources;
+        std::vector<DMR_MergeEntry_t> Heap;
+        uint64_t Sequence;
+        uint64_t LastTime;
+        uint64_t Events;
+        uint64_t Late; // Events that arrived after newer ones were emitted
+        size_t MaxOpen;
+} DMR_Merge_t;
+
+typedef struct {
+        DMR_Event_t Event;
+        uint16_t FrameLength;
+        uint8_t Frame[sizeof(DMR_Frame_t) + 0x100];
+} DMR_RingRecord_t;
+
+typedef struct {
+        uint32_t Magic;
+        uint32_t Version;
+        uint32_t SlotCount;
+        uint32_t SlotSize;
+        alignas(64) std::atomic<uint64_t> Head; // Sequence of the last complete record
+} DMR_RingHeader_t;
+
+typedef struct {
+        alignas(64) std::atomic<uint64_t> Sequence;
+        DMR_RingRecord_t Record;
+} DMR_RingSlot_t;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The event ring needs lock-free 64-bit atomics");
+static_assert(sizeof(DMR_RingHeader_t) % 64 == 0 && sizeof(DMR_RingSlot_t) % 64 == 0, "Event ring slots must be cache line aligned");
+
+typedef struct {
+        uint32_t Magic;
+        uint32_t Count;
+        uint32_t Size;
+        uint16_t Sum;
+        uint16_t Reserved;
+} DMR_ArchiveBlock_t;
+
+// The index file (.dmi) is this header and a DMR_ArchiveIndex_t per block
+typedef struct {
+        uint32_t Magic;
+        uint32_t Version;
+        uint32_t EntrySize;
+        uint32_t Reserved;
+} DMR_ArchiveIndexHeader_t;
+
+typedef struct {
+        uint64_t Offset;
+        uint64_t MinTime;
+        uint64_t MaxTime;
+        uint32_t Size;
+        uint32_t Count;
+        uint64_t Filter[ARCHIVE_FILTER_BITS / 64];
+} DMR_ArchiveIndex_t;
+
+typedef struct {
+        const char *pDataFile;
+        const char *pIndexFile;
+        HANDLE hData;
+        HANDLE hIndex;
+        uint64_t Size; // Bytes of complete, indexed blocks
+        std::mutex Mutex;
+        std::vector<DMR_ArchiveIndex_t> Entries;
+        std::vector<DMR_Event_t> Pending;
+        std::deque<std::vector<DMR_Event_t>> Queue; // Blocks waiting for the archive thread
+        std::unique_ptr<std::thread> Thread;
+        std::condition_variable Wake;
+        std::condition_variable Done;
+        bool bStop;
+        uint64_t Lost;
+} DMR_Archive_t;
+
+typedef struct {
+        const char *pExtension;
+        const char *pHeader; // Written at the top of each file
+        void (*Format)(const DMR_Event_t &Event, std::string &Out);
+} DMR_SinkFormat_t;
+
+typedef struct {
+        const DMR_SinkFormat_t *pFormat;
+        std::thread Thread;
+        std::mutex Mutex;
+        std::condition_variable Wake;
+        std::vector<DMR_Event_t> Queue;
+        bool bStop;
+        uint64_t Dropped;
+        uint64_t Failed;
+        // Set before the sink thread starts; 0 disables size or time rotation
+        const char *pPrefix; // Start of the file names
+        uint64_t SyncInterval;
+        uint64_t RotateSize;
+        uint64_t RotateTime;
+        // Owned by the sink thread
+        HANDLE hFile;
+        std::string Name;
+        uint32_t Sequence;
+        uint64_t Size;
+        uint64_t Opened;
+        uint64_t Synced;
+} DMR_Sink_t;
+
+typedef struct {
+        uint32_t Types; // Bit mask of DMR_EVENT_*
+        uint32_t Source; // 0 matches any ID
+        uint32_t Destination; // 0 matches any ID
+        int ColorCode; // -1 matches any CC
+} DMR_Filter_t;
+
+typedef struct {
+        DMR_Event_t Event;
+        LONGLONG Ticks; // Performance counter when the event was published
+        std::vector<uint8_t> Binary;
+        std::string Text;
+} DMR_Message_t;
+
+typedef struct {
+        SOCKET Socket;
+        std::string Name;
+        std::string Request;
+        bool bSubscribed;
+        bool bText;
+        ULONGLONG Connected; // Tick count when accepted
+        DMR_Filter_t Filter;
+        std::deque<std::shared_ptr<DMR_Message_t>> Queue;
+        std::string Output; // Batch being sent
+        std::vector<LONGLONG> OutputTicks;
+        size_t Offset; // Bytes of Output already sent
+        uint64_t Sent;
+        uint64_t Dropped;
+        ULONGLONG FullSince; // Tick count when the queue last filled up, 0 if not full
+        LONGLONG Latency;
+        LONGLONG MaxLatency;
+} DMR_Subscriber_t;
+
+typedef struct {
+        uint64_t From;
+        uint64_t To;
+        uint32_t Source; // 0 matches any ID
+        uint32_t Destination; // 0 matches any ID
+} DMR_ArchiveQuery_t;
+
+typedef struct {
+        uint64_t Time;
+        std::string Text;
+} DMR_SearchDoc_t;
+
+typedef struct {
+        size_t Start; // Docs before Start have been evicted
+        std::vector<uint64_t> Docs;
+} DMR_Posting_t;
+
+typedef struct {
+        std::mutex Mutex;
+        std::vector<DMR_SearchDoc_t> Docs; // Ring of SCROLLBACK_LINES events
+        uint64_t Next; // Number of the next event
+        uint64_t First; // First event whose line is still in the log pane
+        size_t Sweep; // Next bucket of Postings to sweep
+        std::unordered_map<uint64_t, DMR_Posting_t> Postings;
+} DMR_Search_t;
+
+// Lines added to the log pane by one WM_LOG_MESSAGE
+typedef struct {
+        size_t Lines;
+        uint64_t End; // Character position after the batch, counting trimmed characters
+        uint64_t Events; // Events indexed before the batch was taken from logQueue
+} DMR_LogBatch_t;
+
+typedef struct {
+        uint32_t Calls;
+        uint32_t Detected;
+        uint32_t Airtime; // Milliseconds
+        uint32_t Busy; // Milliseconds
+} DMR_AnalyticsCount_t;
+
+typedef struct {
+        uint32_t Index; // Bucket number since the Unix epoch
+        DMR_AnalyticsCount_t Count;
+} DMR_AnalyticsBucket_t;
+
+typedef struct {
+        uint64_t LastTime;
+        uint32_t Period; // Tumbling period that Current belongs to
+        DMR_AnalyticsCount_t Current;
+        DMR_AnalyticsCount_t Previous;
+        DMR_AnalyticsBucket_t Bucket[ANALYTICS_BUCKETS];
+} DMR_AnalyticsKey_t;
+
+typedef struct {
+        uint64_t CallStart; // 0 when no call is in progress
+        uint64_t BusySince; // 0 when idle
+        uint32_t Source;
+        uint32_t Destination;
+        uint8_t CallType;
+        uint8_t ColorCode;
+        uint8_t Slot;
+        bool bColorCode;
+        bool bSlot;
+} DMR_AnalyticsChannel_t;
+
+typedef struct {
+        uint64_t FirstTime;
+        uint64_t LastTime;
+        uint64_t LastSweep;
+        uint64_t Dropped;
+        std::unordered_map<uint64_t, DMR_AnalyticsKey_t> Keys; // Dimension << 32 | Id
+        DMR_AnalyticsChannel_t Channel[256]; // Indexed by port
+} DMR_Analytics_t;
+
+typedef struct {
+        uint64_t Key;
+        DMR_AnalyticsCount_t Window;
+        DMR_AnalyticsCount_t Current;
+        DMR_AnalyticsCount_t Previous;
+} DMR_AnalyticsResult_t;
+
+// What a report needs, collected under analyticsMutex and logged without it
+typedef struct {
+        uint64_t Now;
+        uint64_t FirstTime;
+        uint64_t Dropped;
+        size_t Keys;
+        int Dimension; // -1 for all of them
+        LONGLONG Ticks; // Spent collecting
+        std::vector<DMR_AnalyticsResult_t> Results[DMR_ANALYTICS_DIMENSIONS];
+} DMR_AnalyticsReport_t;
+
 static HWND hMainWnd = NULL;
 static HWND hComPortList = NULL;
 static HWND hRefreshButton = NULL;
 static HWND hStartStopButton = NULL;
 static HWND hLogPane = NULL;
+static HWND hCommandEdit = NULL;
+static HWND hRunButton = NULL;
 
 static volatile bool isCapturing;
+static DMR_Recorder_t recorder;
 static std::unique_ptr<std::thread> Thread;
 static HANDLE hComPort = INVALID_HANDLE_VALUE;
 static std::mutex logMutex;
 static std::vector<std::string> logQueue;
-static std::vector<uint8_t> dataBuffer;
+static size_t logLines;
+static std::deque<DMR_LogBatch_t> logBatches;
+static uint64_t logTrimmed; // Characters dropped from the top of the log pane
 static volatile bool bQuitting;
+static std::mutex profilerMutex;
+static DMR_Profiler_t profiler;
+static DMR_Decoder_t liveDecoder = { 0, {}, {}, &recorder, &profiler };
+
+static DMR_Archive_t archive = { ARCHIVE_DATA_FILE, ARCHIVE_INDEX_FILE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+
+static std::mutex sinkMutex;
+static std::vector<std::unique_ptr<DMR_Sink_t>> sinks;
+
+static std::unique_ptr<std::thread> publishThread;
+static volatile bool bPublishing;
+static volatile bool publishStop;
+static SOCKET publishTcp = INVALID_SOCKET;
+static SOCKET publishUnix = INVALID_SOCKET;
+static SOCKET publishWake = INVALID_SOCKET;
+static SOCKET publishPoke = INVALID_SOCKET;
+static sockaddr_in publishWakeAddress;
+static std::mutex publishMutex;
+static std::vector<std::shared_ptr<DMR_Message_t>> publishInbox;
+static uint64_t publishDropped;
+static uint16_t publishPort; // TCP port listened on, as picked by the system for port 0
+static std::mutex subscriberMutex;
+static std::vector<std::unique_ptr<DMR_Subscriber_t>> subscribers;
+
+static std::unique_ptr<std::thread> recorderThread;
+static volatile bool recorderStop;
+static volatile bool recorderManual;
+static std::mutex recorderMutex;
+static std::condition_variable recorderWake;
+static std::deque<std::unique_ptr<DMR_Snapshot_t>> recorderQueue;
+static std::vector<uint32_t> recorderWatch;
+static uint64_t recorderDropped;
+
+static std::unique_ptr<std::thread> stateThread;
+static std::condition_variable stateWake;
+static volatile bool stateStop;
+static volatile bool stateSave;
+static DMR_State_t state = { STATE_FILE, STATE_TEMP_FILE };
+
+static std::unique_ptr<std::thread> mergeThread;
+static volatile bool mergeRunning;
+static volatile bool mergeAbort;
+static std::unique_ptr<std::thread> benchThread;
+static volatile bool benchRunning;
+
+static DMR_Search_t search;
+static std::vector<uint64_t> searchTerms; // Last query, for "find more"
+static uint64_t searchCursor;
+
+static std::mutex analyticsMutex;
+static DMR_Analytics_t analytics;
+
+static HANDLE hRing = NULL;
+static DMR_RingHeader_t *pRing;
+static HANDLE hRingMutex = NULL; // Held while this instance is the ring's writer
 
 static void AddLogMessage(const std::string &Message)
 {
@@ -120,559 +688,5468 @@ static uint16_t GenCheckSum(const void *pData, size_t Length)
         return (uint16_t)(Sum ^ 0xFFFFU);
 }
 
-static bool ProcessMessage(uint8_t *pData, size_t &Length, char *pOut, size_t OutLength)
+static uint64_t GetTimeStamp(void)
 {
-        DMR_Frame_t *pFrame = (DMR_Frame_t *)pData;
+        FILETIME ft;
+        ULARGE_INTEGER Time;
+
+        GetSystemTimeAsFileTime(&ft);
+        Time.LowPart = ft.dwLowDateTime;
+        Time.HighPart = ft.dwHighDateTime;
+
+        return (Time.QuadPart - 116444736000000000ULL) / 10000;
+}
+
+static const char *GetCallType(uint8_t CallType)
+{
+        return (CallType == 0x01) ? "Private" : ((CallType == 0x02) ? "Group" : "All");
+}
+
+static void FormatEvent(const DMR_Event_t &Event, char *pOut, size_t OutLength)
+{
+        uint8_t i;
 
         pOut[0] = 0;
 
-        if (pFrame->Head == DMR_FRAME_HEAD && Length >= sizeof(DMR_Frame_t) + 1) {
-                const uint16_t DataLength = (pFrame->Length[0] << 8) | pFrame->Length[1];
-                const uint16_t FrameLength = sizeof(DMR_Frame_t) + 1 + DataLength;
+        switch (Event.Type) {
+        case DMR_EVENT_CALL_START:
+                sprintf_s(pOut, OutLength, "%s call started from %08u to %08u", GetCallType(Event.CallType), Event.Source, Event.Destination);
+                break;
 
-                if (DataLength >= 0x100) {
-                        Length = 1;
-                        return false;
-                }
+        case DMR_EVENT_CALL_END:
+                sprintf_s(pOut, OutLength, "Call ended");
+                break;
 
-                if (Length >= FrameLength) {
-                        if (pFrame->Data[DataLength] != DMR_FRAME_TAIL) {
-                                Length = 1;
-                                return false;
-                        }
+        case DMR_EVENT_DETECTED:
+                sprintf_s(pOut, OutLength, "Detected %s call from %08u to %08u in CC%d", GetCallType(Event.CallType), Event.Source, Event.Destination, Event.ColorCode);
+                break;
 
-                        const uint16_t Sum = (pFrame->Sum[0] << 8) | pFrame->Sum[1];
+        case DMR_EVENT_ALIAS:
+                sprintf_s(pOut, OutLength, "Talker Alias(%d): %s", Event.AliasFormat, Event.Alias);
+                break;
 
-                        pFrame->Sum[0] = 0xFF;
-                        pFrame->Sum[1] = 0xFF;
+        case DMR_EVENT_GPS:
+        {
+                double Lon = (double)Event.Longitude * 360 / 33554432;
+                double Lat = (double)Event.Latitude * 180 / 16777216;
+                char LonDirection = 'E';
+                char LatDirection = 'N';
+
+                if (Lon < 0.0) {
+                        Lon = -Lon;
+                        LonDirection = 'W';
+                }
+                if (Lat < 0.0) {
+                        Lat = -Lat;
+                        LatDirection = 'S';
+                }
 
-                        if (GenCheckSum(pFrame, FrameLength) != Sum) {
-                                Length = 1;
+                sprintf_s(pOut, OutLength, "GPS: %.6f%c %.6f%c", Lat, LatDirection, Lon, LonDirection);
+                break;
+        }
 
-                                return false;
-                        }
+        case DMR_EVENT_CHANNEL:
+                sprintf_s(pOut, OutLength, "Set Channel: TS%d CC%d RX %d TX %d", Event.Slot, Event.ColorCode, Event.RxFrequency, Event.TxFrequency);
+                break;
 
-                        switch (pFrame->Command) {
-                        case 0x02:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 1) {
-                                                sprintf_s(pOut, OutLength, "Set RX Volume to %d", pFrame->Data[0]);
-                                        }
-                                }
-                                break;
+        case DMR_EVENT_GROUP_LIST:
+                if (!Event.Count) {
+                        strcat_s(pOut, OutLength, "Cleared group list");
+                        break;
+                }
+                strcat_s(pOut, OutLength, "Set group list:");
+                for (i = 0; i < Event.Count; i++) {
+                        char Group[16];
 
-                        case 0x05: // Ignore signal checks for now
-                                break;
+                        sprintf_s(Group, sizeof(Group), " %d", Event.Groups[i]);
+                        strcat_s(pOut, OutLength, Group);
+                }
+                break;
 
-                        case 0x06:
-                                if (pFrame->RW == DMR_RW_UPLOAD) {
-                                        if (pFrame->Length[1] == 0x09) {
-                                                sprintf_s(pOut, OutLength, "%s call started from %02X%02X%02X%02X to %02X%02X%02X%02X",
-                                                        (pFrame->Data[0] == 0x01) ? "Private" : ((pFrame->Data[0] == 0x02) ? "Group" : "All"),
-                                                        pFrame->Data[5], pFrame->Data[6], pFrame->Data[7], pFrame->Data[8],
-                                                        pFrame->Data[1], pFrame->Data[2], pFrame->Data[3], pFrame->Data[4]);
-                                        } else {
-                                                sprintf_s(pOut, OutLength, "Call ended");
-                                        }
-                                }
-                                break;
+        case DMR_EVENT_BUSY:
+                sprintf_s(pOut, OutLength, "Channel is %s", Event.Busy ? "Busy" : "Idle");
+                break;
+        }
+}
 
-                        case 0x09: // Alarm
-                                break;
+// Flags a snapshot of the reads from RECORDER_PRE_TIME before now, taken once
+// RECORDER_POST_TIME has passed and written by the recorder thread
+static void RecorderTrigger(DMR_Recorder_t &Recorder, const char *pReason)
+{
+        if (Recorder.TriggerTime || Recorder.Time - Recorder.LastTrigger < RECORDER_HOLDOFF) {
+                return;
+        }
 
-                        case 0x0B:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 1) {
-                                                sprintf_s(pOut, OutLength, "Set MIC Gain to %d", pFrame->Data[0]);
-                                        }
-                                }
-                                break;
+        Recorder.TriggerTime = Recorder.Time;
+        strcpy_s(Recorder.Reason, sizeof(Recorder.Reason), pReason);
+}
 
-                        case 0x0C:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 1) {
-                                                sprintf_s(pOut, OutLength, "Set Power Saving Mode to %s",
-                                                        (pFrame->Data[0] == 00) ? "Off" : (
-                                                        (pFrame->Data[0] == 0x01) ? "Level 1" : (
-                                                        (pFrame->Data[0] == 0x02) ? "Level 2" : "Level 3"))
-                                                        );
-                                        }
-                                }
-                                break;
+static void RecorderFailure(DMR_Recorder_t &Recorder)
+{
+        if (Recorder.Time - Recorder.BurstStart > RECORDER_BURST_TIME) {
+                Recorder.BurstStart = Recorder.Time;
+                Recorder.BurstCount = 0;
+        }
+        if (++Recorder.BurstCount == RECORDER_BURST_COUNT) {
+                RecorderTrigger(Recorder, "checksum-burst");
+        }
+}
 
-                        case 0x1A:
-                                strcat_s(pOut, OutLength, "Initialization Status");
-                                break;
+static void RecorderWatch(DMR_Recorder_t &Recorder, const DMR_Event_t &Event)
+{
+        char Reason[32];
+        bool bWatched;
 
-                        case 0x25:
-                                if (pFrame->RW == DMR_RW_TO_HOST) {
-                                        if (DataLength == 4) {
-                                                sprintf_s(pOut, OutLength, "Firmware: %X.%X.%X.%X", pFrame->Data[0], pFrame->Data[1], pFrame->Data[2], pFrame->Data[3]);
-                                        }
-                                }
-                                break;
+        if (Event.Type != DMR_EVENT_CALL_START && Event.Type != DMR_EVENT_DETECTED) {
+                return;
+        }
 
-                        case 0x2A:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 4) {
-                                                sprintf_s(pOut, OutLength, "Set Local ID: %02X%02X%02X%02X", pFrame->Data[3], pFrame->Data[2], pFrame->Data[1], pFrame->Data[0]);
-                                        }
-                                }
-                                break;
+        {
+                std::lock_guard<std::mutex> lock(recorderMutex);
+                bWatched = std::binary_search(recorderWatch.begin(), recorderWatch.end(), Event.Source) ||
+                        std::binary_search(recorderWatch.begin(), recorderWatch.end(), Event.Destination);
+        }
+        if (bWatched) {
+                sprintf_s(Reason, sizeof(Reason), "watch-%u-%u", Event.Source, Event.Destination);
+                RecorderTrigger(Recorder, Reason);
+        }
+}
 
-                        case 0x3E:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        strcat_s(pOut, OutLength, "Wake Up");
-                                }
-                                break;
+static void RecorderSnapshot(DMR_Recorder_t &Recorder)
+{
+        std::unique_ptr<DMR_Snapshot_t> pSnapshot(new DMR_Snapshot_t());
+        const uint64_t Oldest = (Recorder.Written > RECORDER_BYTES) ? Recorder.Written - RECORDER_BYTES : 0;
+        const size_t Chunks = (Recorder.Chunks < RECORDER_CHUNKS) ? (size_t)Recorder.Chunks : RECORDER_CHUNKS;
+        DMR_RecordingHeader_t Header;
+        size_t i;
 
-                        case 0x42:
-                                strcat_s(pOut, OutLength, "Deep Sleep Mode");
-                                break;
+        Header.Magic = RECORDING_MAGIC;
+        Header.Version = RECORDING_VERSION;
+        Header.Port = Recorder.Port;
+        Header.Reserved = 0;
+        pSnapshot->Data.insert(pSnapshot->Data.end(), (const uint8_t *)&Header, (const uint8_t *)(&Header + 1));
 
-                        case 0x45:
-                                strcat_s(pOut, OutLength, "Set Alarm Configuration");
-                                break;
+        for (i = 0; i < Chunks; i++) {
+                const DMR_Chunk_t &Chunk = Recorder.Chunk[(Recorder.Chunks - Chunks + i) % RECORDER_CHUNKS];
+                DMR_RecordingChunk_t Record;
+                size_t Offset, Length;
 
-                        case 0x48: // Remote monitoring duration
-                                break;
+                if (Chunk.Position < Oldest || Chunk.Time + RECORDER_PRE_TIME < Recorder.TriggerTime) {
+                        continue;
+                }
 
-                        case 0x4C: // Enable VHF/UHF switch
-                                break;
+                Record.Time = Chunk.Time;
+                Record.Length = Chunk.Length;
+                pSnapshot->Data.insert(pSnapshot->Data.end(), (const uint8_t *)&Record, (const uint8_t *)(&Record + 1));
 
-                        case 0x4D:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 1) {
-                                                sprintf_s(pOut, OutLength, "Set Squelch Level to %d", pFrame->Data[0]);
-                                        }
-                                }
-                                break;
+                Offset = (size_t)(Chunk.Position % RECORDER_BYTES);
+                Length = (Chunk.Length < RECORDER_BYTES - Offset) ? Chunk.Length : RECORDER_BYTES - Offset;
+                pSnapshot->Data.insert(pSnapshot->Data.end(), Recorder.Bytes + Offset, Recorder.Bytes + Offset + Length);
+                pSnapshot->Data.insert(pSnapshot->Data.end(), Recorder.Bytes, Recorder.Bytes + Chunk.Length - Length);
+        }
 
-                        case 0x59: // Digital service status
-                                if (pFrame->RW == DMR_RW_UPLOAD) {
-                                        sprintf_s(pOut, OutLength, "Channel is %s", pFrame->Data[0] ? "Busy" : "Idle");
-                                }
-                                break;
+        pSnapshot->Time = Recorder.TriggerTime;
+        strcpy_s(pSnapshot->Reason, sizeof(pSnapshot->Reason), Recorder.Reason);
 
-                        case 0x60:
-                                if (DataLength == 34 && pFrame->Data[0] == 2) {
-                                        char String[128];
-                                        wchar_t WString[128];
-                                        int Len;
-                                        uint8_t i;
+        Recorder.LastTrigger = Recorder.TriggerTime;
+        Recorder.TriggerTime = 0;
 
-                                        switch (pFrame->Data[1]) {
-                                        case 0:
-                                        case 2:
-                                                memcpy(String, pFrame->Data + 3, pFrame->Data[2]);
-                                                String[pFrame->Data[2]] = 0;
-                                                break;
+        {
+                std::lock_guard<std::mutex> lock(recorderMutex);
 
-                                        case 1:
-                                                Len = MultiByteToWideChar(28591, 0, (char *)pFrame->Data + 3, pFrame->Data[2], WString, 128);
-                                                Len = WideCharToMultiByte(CP_UTF8, 0, WString, Len, String, 127, NULL, NULL);
-                                                String[Len] = 0;
-                                                break;
+                if (recorderQueue.size() >= RECORDER_MAX_PENDING) {
+                        recorderDropped++;
+                        return;
+                }
+                recorderQueue.push_back(std::move(pSnapshot));
+        }
+        recorderWake.notify_one();
+}
 
-                                        case 3:
-                                                for (i = 0; i < pFrame->Data[2]; i++) {
-                                                        WString[i] = (pFrame->Data[3 + (i * 2) + 0] << 8) | pFrame->Data[3 + (i * 2) + 1];
-                                                }
-                                                WString[i] = 0;
-                                                Len = WideCharToMultiByte(CP_UTF8, 0, WString, i, String, 127, NULL, NULL);
-                                                String[Len] = 0;
-                                                break;
+// Runs on every read, the empty ones of an idle link included, so a manual
+// trigger or a due snapshot doesn't wait for the radio to send something
+static void RecorderTick(DMR_Recorder_t &Recorder, uint64_t Time)
+{
+        Recorder.Time = Time;
+
+        if (recorderManual) {
+                recorderManual = false;
+                Recorder.LastTrigger = 0;
+                RecorderTrigger(Recorder, "manual");
+        }
+        if (Recorder.TriggerTime && Time - Recorder.TriggerTime >= RECORDER_POST_TIME) {
+                RecorderSnapshot(Recorder);
+        }
+}
+
+static void RecorderAppend(DMR_Recorder_t &Recorder, const uint8_t *pData, size_t Length, uint64_t Time)
+{
+        if (Length > RECORDER_BYTES) {
+                return;
+        }
+
+        DMR_Chunk_t &Chunk = Recorder.Chunk[Recorder.Chunks++ % RECORDER_CHUNKS];
+        const size_t Offset = (size_t)(Recorder.Written % RECORDER_BYTES);
+        const size_t First = (Length < RECORDER_BYTES - Offset) ? Length : RECORDER_BYTES - Offset;
+
+        Chunk.Time = Time;
+        Chunk.Position = Recorder.Written;
+        Chunk.Length = (uint32_t)Length;
+
+        memcpy(Recorder.Bytes + Offset, pData, First);
+        memcpy(Recorder.Bytes, pData + First, Length - First);
+        Recorder.Written += Length;
+
+        RecorderTick(Recorder, Time);
+}
+
+static void RecorderThread(void)
+{
+        for (;;) {
+                std::unique_ptr<DMR_Snapshot_t> pSnapshot;
+                char Name[MAX_PATH];
+                char Tmp[512];
+                time_t Time;
+                HANDLE hFile;
+                DWORD Written;
+                tm ti;
+
+                {
+                        std::unique_lock<std::mutex> lock(recorderMutex);
+
+                        recorderWake.wait(lock, [] {
+                                return recorderStop || recorderQueue.size();
+                        });
+                        if (recorderQueue.empty()) {
+                                return;
+                        }
+                        pSnapshot = std::move(recorderQueue.front());
+                        recorderQueue.pop_front();
+                }
+
+                Time = (time_t)(pSnapshot->Time / 1000);
+                localtime_s(&ti, &Time);
+                strftime(Tmp, sizeof(Tmp), "%Y%m%d-%H%M%S", &ti);
+                sprintf_s(Name, sizeof(Name), "DigiMonitoR-%s-%s.dmc", Tmp, pSnapshot->Reason);
+
+                hFile = CreateFile(Name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (hFile == INVALID_HANDLE_VALUE) {
+                        sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create flight recorder snapshot %s.", Name);
+                        AddLogMessage(Tmp);
+                        continue;
+                }
+                if (WriteFile(hFile, pSnapshot->Data.data(), (DWORD)pSnapshot->Data.size(), &Written, NULL) && Written == pSnapshot->Data.size()) {
+                        sprintf_s(Tmp, sizeof(Tmp), "Flight recorder: saved %zu bytes to %s.", pSnapshot->Data.size(), Name);
+                } else {
+                        sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to write flight recorder snapshot %s.", Name);
+                }
+                CloseHandle(hFile);
+                AddLogMessage(Tmp);
+        }
+}
+
+static void RecorderStart(void)
+{
+        recorderStop = false;
+        recorderThread = std::make_unique<std::thread>(RecorderThread);
+}
+
+static void RecorderStop(void)
+{
+        if (!recorderThread) {
+                return;
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(recorderMutex);
+                recorderStop = true;
+        }
+        recorderWake.notify_one();
+        recorderThread->join();
+        recorderThread.reset();
+}
+
+// Discovery mode: aggregates undecoded frames per command, direction and length instead of dumping them
+static bool ProfileFrame(DMR_Profiler_t *pProfiler, const DMR_Frame_t *pFrame, uint16_t DataLength, uint64_t Time)
+{
+        const uint32_t Key = (pFrame->Command << 16) | (pFrame->RW << 8) | DataLength;
+        DMR_Profile_t *pProfile;
+        LARGE_INTEGER Begin, End;
+        bool bTimed;
+        size_t i;
+
+        if (!pProfiler || !pProfiler->bEnabled) {
+                return false;
+        }
+
+        std::lock_guard<std::mutex> lock(profilerMutex);
+
+        // Reading the counter costs about as much as a short frame does
+        bTimed = !(pProfiler->Frames++ % PROFILE_TIMING_SAMPLE);
+        if (bTimed) {
+                QueryPerformanceCounter(&Begin);
+        }
+
+        auto it = pProfiler->Profiles.find(Key);
+        if (it == pProfiler->Profiles.end()) {
+                if (pProfiler->Profiles.size() >= PROFILE_MAX_KEYS) {
+                        pProfiler->Dropped++;
+                        if (bTimed) {
+                                QueryPerformanceCounter(&End);
+                                pProfiler->Ticks += End.QuadPart - Begin.QuadPart;
+                                pProfiler->Timed++;
+                        }
+                        return true;
+                }
+                pProfile = new DMR_Profile_t();
+                pProfile->Command = pFrame->Command;
+                pProfile->RW = pFrame->RW;
+                pProfile->Length = DataLength;
+                pProfile->FirstTime = Time;
+                memcpy(pProfile->First, pFrame->Data, DataLength);
+                pProfiler->Profiles[Key].reset(pProfile);
+        } else {
+                pProfile = it->second.get();
+        }
+
+        pProfile->Count++;
+        pProfile->LastTime = Time;
+
+        for (i = 0; i < DataLength; i++) {
+                pProfile->Varying[i >> 3] |= (uint8_t)((pFrame->Data[i] != pProfile->First[i]) << (i & 7));
+        }
+        for (i = 0; i < DataLength && i < PROFILE_HISTOGRAM_BYTES; i++) {
+                pProfile->Histogram[i][pFrame->Data[i]]++;
+        }
+
+        // Samples are only compared until enough distinct ones have been kept
+        if (pProfile->Samples < PROFILE_SAMPLES) {
+                for (i = 0; i < pProfile->Samples; i++) {
+                        if (!memcmp(pProfile->Sample[i], pFrame->Data, DataLength)) {
+                                break;
+                        }
+                }
+                if (i == pProfile->Samples) {
+                        memcpy(pProfile->Sample[pProfile->Samples++], pFrame->Data, DataLength);
+                }
+        }
+
+        if (bTimed) {
+                QueryPerformanceCounter(&End);
+                pProfiler->Ticks += End.QuadPart - Begin.QuadPart;
+                pProfiler->Timed++;
+        }
+
+        return true;
+}
+
+// Accounts the time spent hex dumping a frame since Begin, so the report can
+// compare it with the cost of aggregating
+static void ProfileDump(DMR_Profiler_t *pProfiler, const LARGE_INTEGER &Begin)
+{
+        LARGE_INTEGER End;
+
+        if (!pProfiler) {
+                return;
+        }
+
+        QueryPerformanceCounter(&End);
+
+        std::lock_guard<std::mutex> lock(profilerMutex);
+
+        pProfiler->Dumps++;
+        pProfiler->DumpTicks += End.QuadPart - Begin.QuadPart;
+}
+
+static void ProfileReport(const DMR_Profiler_t &Profiler)
+{
+        std::vector<DMR_Profile_t> Profiles;
+        std::vector<const DMR_Profile_t *> Order;
+        uint64_t Frames, Dropped, Ticks, Timed, Dumps, DumpTicks;
+        LARGE_INTEGER Frequency;
+        char Tmp[1024];
+        size_t i, j;
+
+        QueryPerformanceFrequency(&Frequency);
+
+        // Copied out so that the capture thread is not held up by the logging
+        {
+                std::lock_guard<std::mutex> lock(profilerMutex);
+
+                Frames = Profiler.Frames;
+                Dropped = Profiler.Dropped;
+                Ticks = Profiler.Ticks;
+                Timed = Profiler.Timed;
+                Dumps = Profiler.Dumps;
+                DumpTicks = Profiler.DumpTicks;
+                Profiles.reserve(Profiler.Profiles.size());
+                for (auto &Entry : Profiler.Profiles) {
+                        Profiles.push_back(*Entry.second);
+                }
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "Discovery %s: %llu frames in %zu profiles, %llu dropped.",
+                Profiler.bEnabled ? "on" : "off", Frames, Profiles.size(), Dropped);
+        AddLogMessage(Tmp);
+        sprintf_s(Tmp, sizeof(Tmp), "  Aggregating %.1f ns per frame (%llu timed), hex dumping %.1f ns per frame (%llu frames).",
+                Timed ? (double)Ticks * 1e9 / Frequency.QuadPart / Timed : 0.0, Timed,
+                Dumps ? (double)DumpTicks * 1e9 / Frequency.QuadPart / Dumps : 0.0, Dumps);
+        AddLogMessage(Tmp);
+
+        for (auto &Profile : Profiles) {
+                Order.push_back(&Profile);
+        }
+        std::sort(Order.begin(), Order.end(), [](const DMR_Profile_t *a, const DMR_Profile_t *b) {
+                return a->Count > b->Count;
+        });
+
+        for (auto pProfile : Order) {
+
+                time_t First = (time_t)(pProfile->FirstTime / 1000);
+                time_t Last = (time_t)(pProfile->LastTime / 1000);
+                char FirstStamp[32], LastStamp[32];
+                std::string Line;
+                tm ti;
+
+                localtime_s(&ti, &First);
+                strftime(FirstStamp, sizeof(FirstStamp), "%Y-%m-%d %H:%M:%S", &ti);
+                localtime_s(&ti, &Last);
+                strftime(LastStamp, sizeof(LastStamp), "%Y-%m-%d %H:%M:%S", &ti);
+                sprintf_s(Tmp, sizeof(Tmp), "Command 0x%02X RW %d, %d bytes: %llu frames from %s to %s",
+                        pProfile->Command, pProfile->RW, pProfile->Length, pProfile->Count, FirstStamp, LastStamp);
+                AddLogMessage(Tmp);
+
+                // Constant bytes are shown with their value, varying ones as ..
+                Line = "  Mask:";
+                for (i = 0; i < pProfile->Length; i++) {
+                        if (pProfile->Varying[i >> 3] & (1 << (i & 7))) {
+                                Line += " ..";
+                        } else {
+                                sprintf_s(Tmp, sizeof(Tmp), " %02X", pProfile->First[i]);
+                                Line += Tmp;
+                        }
+                }
+                AddLogMessage(Line);
+
+                for (i = 0; i < pProfile->Length && i < PROFILE_HISTOGRAM_BYTES; i++) {
+                        const uint32_t *pCounts = pProfile->Histogram[i];
+                        uint8_t Top[PROFILE_TOP_VALUES];
+                        size_t Values = 0;
+                        size_t Kept = 0;
+
+                        if (!(pProfile->Varying[i >> 3] & (1 << (i & 7)))) {
+                                continue;
+                        }
+
+                        for (j = 0; j < 256; j++) {
+                                size_t k;
+
+                                if (!pCounts[j]) {
+                                        continue;
+                                }
+                                Values++;
+
+                                // Insertion into the few most frequent values
+                                for (k = Kept; k > 0 && pCounts[Top[k - 1]] < pCounts[j]; k--) {
+                                        if (k < PROFILE_TOP_VALUES) {
+                                                Top[k] = Top[k - 1];
                                         }
-                                        sprintf_s(pOut, OutLength, "Talker Alias(%d): %s", pFrame->Data[1], String);
-                                } else if (DataLength == 10 && pFrame->Data[0] == 1) {
-                                        int32_t Longitude = (pFrame->Data[2] << 24) | (pFrame->Data[3] << 16) | (pFrame->Data[4] << 8) | pFrame->Data[5];
-                                        int32_t Latitude = (pFrame->Data[6] << 24) | (pFrame->Data[7] << 16) | (pFrame->Data[8] << 8) | pFrame->Data[9];
-                                        char LonDirection = 'E';
-                                        char LatDirection = 'N';
-                                        double Lon;
-                                        double Lat;
+                                }
+                                if (k < PROFILE_TOP_VALUES) {
+                                        Top[k] = (uint8_t)j;
+                                        if (Kept < PROFILE_TOP_VALUES) {
+                                                Kept++;
+                                        }
+                                }
+                        }
+
+                        sprintf_s(Tmp, sizeof(Tmp), "  Byte %zu: %zu values,", i, Values);
+                        Line = Tmp;
+                        for (j = 0; j < Kept; j++) {
+                                sprintf_s(Tmp, sizeof(Tmp), " %02X x%u", Top[j], pCounts[Top[j]]);
+                                Line += Tmp;
+                        }
+                        AddLogMessage(Line);
+                }
+
+                for (i = 0; i < pProfile->Samples; i++) {
+                        Line = "  Sample:";
+                        for (j = 0; j < pProfile->Length; j++) {
+                                sprintf_s(Tmp, sizeof(Tmp), " %02X", pProfile->Sample[i][j]);
+                                Line += Tmp;
+                        }
+                        AddLogMessage(Line);
+                }
+        }
+}
+
+static bool ProcessMessage(uint8_t *pData, size_t &Length, char *pOut, size_t OutLength, DMR_Event_t &Event, DMR_Decoder_t &Decoder)
+{
+        DMR_Frame_t *pFrame = (DMR_Frame_t *)pData;
+        LARGE_INTEGER Begin;
+
+        pOut[0] = 0;
+
+        if (pFrame->Head == DMR_FRAME_HEAD && Length >= sizeof(DMR_Frame_t) + 1) {
+                const uint16_t DataLength = (pFrame->Length[0] << 8) | pFrame->Length[1];
+                const uint16_t FrameLength = sizeof(DMR_Frame_t) + 1 + DataLength;
+
+                if (DataLength >= 0x100) {
+                        Length = 1;
+                        return false;
+                }
+
+                if (Length >= FrameLength) {
+                        if (pFrame->Data[DataLength] != DMR_FRAME_TAIL) {
+                                Length = 1;
+                                return false;
+                        }
+
+                        const uint16_t Sum = (pFrame->Sum[0] << 8) | pFrame->Sum[1];
+
+                        pFrame->Sum[0] = 0xFF;
+                        pFrame->Sum[1] = 0xFF;
+
+                        if (GenCheckSum(pFrame, FrameLength) != Sum) {
+                                Length = 1;
+
+                                return false;
+                        }
+
+                        pFrame->Sum[0] = (uint8_t)(Sum >> 8);
+                        pFrame->Sum[1] = (uint8_t)Sum;
+
+                        Event.Command = pFrame->Command;
+                        Event.RW = pFrame->RW;
+
+                        switch (pFrame->Command) {
+                        case 0x02:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 1) {
+                                                sprintf_s(pOut, OutLength, "Set RX Volume to %d", pFrame->Data[0]);
+                                        }
+                                }
+                                break;
+
+                        case 0x05: // Signal checks, not decoded yet
+                                ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time);
+                                break;
+
+                        case 0x06:
+                                if (pFrame->RW == DMR_RW_UPLOAD) {
+                                        if (pFrame->Length[1] == 0x09) {
+                                                Event.Type = DMR_EVENT_CALL_START;
+                                                Event.CallType = pFrame->Data[0];
+                                                Event.Source = GetId(&pFrame->Data[5]);
+                                                Event.Destination = GetId(&pFrame->Data[1]);
+                                                Decoder.CurrentCall = Event;
+                                        } else {
+                                                Event.Type = DMR_EVENT_CALL_END;
+                                                Event.CallType = Decoder.CurrentCall.CallType;
+                                                Event.Source = Decoder.CurrentCall.Source;
+                                                Event.Destination = Decoder.CurrentCall.Destination;
+                                                memset(&Decoder.CurrentCall, 0, sizeof(Decoder.CurrentCall));
+                                        }
+                                        FormatEvent(Event, pOut, OutLength);
+                                }
+                                break;
+
+                        case 0x09: // Alarm
+                                ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time);
+                                break;
+
+                        case 0x0B:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 1) {
+                                                sprintf_s(pOut, OutLength, "Set MIC Gain to %d", pFrame->Data[0]);
+                                        }
+                                }
+                                break;
+
+                        case 0x0C:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 1) {
+                                                sprintf_s(pOut, OutLength, "Set Power Saving Mode to %s",
+                                                        (pFrame->Data[0] == 00) ? "Off" : (
+                                                        (pFrame->Data[0] == 0x01) ? "Level 1" : (
+                                                        (pFrame->Data[0] == 0x02) ? "Level 2" : "Level 3"))
+                                                        );
+                                        }
+                                }
+                                break;
+
+                        case 0x1A:
+                                if (!ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time)) {
+                                        strcat_s(pOut, OutLength, "Initialization Status");
+                                }
+                                break;
+
+                        case 0x25:
+                                if (pFrame->RW == DMR_RW_TO_HOST) {
+                                        if (DataLength == 4) {
+                                                sprintf_s(pOut, OutLength, "Firmware: %X.%X.%X.%X", pFrame->Data[0], pFrame->Data[1], pFrame->Data[2], pFrame->Data[3]);
+                                        }
+                                }
+                                break;
+
+                        case 0x2A:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 4) {
+                                                sprintf_s(pOut, OutLength, "Set Local ID: %02X%02X%02X%02X", pFrame->Data[3], pFrame->Data[2], pFrame->Data[1], pFrame->Data[0]);
+                                        }
+                                }
+                                break;
+
+                        case 0x3E:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        strcat_s(pOut, OutLength, "Wake Up");
+                                }
+                                break;
+
+                        case 0x42:
+                                strcat_s(pOut, OutLength, "Deep Sleep Mode");
+                                break;
+
+                        case 0x45:
+                                strcat_s(pOut, OutLength, "Set Alarm Configuration");
+                                break;
+
+                        case 0x48: // Remote monitoring duration
+                                ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time);
+                                break;
+
+                        case 0x4C: // Enable VHF/UHF switch
+                                ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time);
+                                break;
+
+                        case 0x4D:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 1) {
+                                                sprintf_s(pOut, OutLength, "Set Squelch Level to %d", pFrame->Data[0]);
+                                        }
+                                }
+                                break;
+
+                        case 0x59: // Digital service status
+                                if (pFrame->RW == DMR_RW_UPLOAD) {
+                                        Event.Type = DMR_EVENT_BUSY;
+                                        Event.Busy = pFrame->Data[0] ? 1 : 0;
+                                        FormatEvent(Event, pOut, OutLength);
+                                }
+                                break;
+
+                        case 0x60:
+                                if (DataLength == 34 && pFrame->Data[0] == 2) {
+                                        char String[128] = "";
+                                        wchar_t WString[128];
+                                        int Len;
+                                        uint8_t i;
+
+                                        switch (pFrame->Data[1]) {
+                                        case 0:
+                                        case 2:
+                                                memcpy(String, pFrame->Data + 3, pFrame->Data[2]);
+                                                String[pFrame->Data[2]] = 0;
+                                                break;
+
+                                        case 1:
+                                                Len = MultiByteToWideChar(28591, 0, (char *)pFrame->Data + 3, pFrame->Data[2], WString, 128);
+                                                Len = WideCharToMultiByte(CP_UTF8, 0, WString, Len, String, 127, NULL, NULL);
+                                                String[Len] = 0;
+                                                break;
+
+                                        case 3:
+                                                for (i = 0; i < pFrame->Data[2]; i++) {
+                                                        WString[i] = (pFrame->Data[3 + (i * 2) + 0] << 8) | pFrame->Data[3 + (i * 2) + 1];
+                                                }
+                                                WString[i] = 0;
+                                                Len = WideCharToMultiByte(CP_UTF8, 0, WString, i, String, 127, NULL, NULL);
+                                                String[Len] = 0;
+                                                break;
+                                        }
+                                        Event.Type = DMR_EVENT_ALIAS;
+                                        Event.Source = Decoder.CurrentCall.Source;
+                                        Event.Destination = Decoder.CurrentCall.Destination;
+                                        Event.AliasFormat = pFrame->Data[1];
+                                        strcpy_s(Event.Alias, sizeof(Event.Alias), String);
+                                        Event.Count = (uint8_t)strlen(Event.Alias);
+                                        FormatEvent(Event, pOut, OutLength);
+                                } else if (DataLength == 10 && pFrame->Data[0] == 1) {
+                                        int32_t Longitude = (pFrame->Data[2] << 24) | (pFrame->Data[3] << 16) | (pFrame->Data[4] << 8) | pFrame->Data[5];
+                                        int32_t Latitude = (pFrame->Data[6] << 24) | (pFrame->Data[7] << 16) | (pFrame->Data[8] << 8) | pFrame->Data[9];
+
+                                        Longitude &= 0x1FFFFFF;
+                                        Longitude <<= 7;
+                                        Longitude >>= 7;
+                                        Latitude &= 0xFFFFFF;
+                                        Latitude <<= 8;
+                                        Latitude >>= 8;
+
+                                        Event.Type = DMR_EVENT_GPS;
+                                        Event.Source = Decoder.CurrentCall.Source;
+                                        Event.Destination = Decoder.CurrentCall.Destination;
+                                        Event.Latitude = Latitude;
+                                        Event.Longitude = Longitude;
+                                        FormatEvent(Event, pOut, OutLength);
+                                } else {
+                                        uint8_t i;
+
+                                        sprintf_s(pOut, OutLength, "In Band:");
+
+                                        for (i = 0; i < DataLength; i++) {
+                                                char Tmp[8];
+
+                                                sprintf_s(Tmp, sizeof(Tmp), " %02X", pFrame->Data[i]);
+                                                strcat_s(pOut, OutLength, Tmp);
+                                        }
+                                }
+                                break;
+
+                        case 0x62:
+                                if (DataLength == 10) {
+                                        Event.Type = DMR_EVENT_DETECTED;
+                                        Event.CallType = pFrame->Data[0];
+                                        Event.Source = GetId(&pFrame->Data[5]);
+                                        Event.Destination = GetId(&pFrame->Data[1]);
+                                        Event.ColorCode = pFrame->Data[9];
+                                        FormatEvent(Event, pOut, OutLength);
+                                }
+                                break;
+
+                        case 0x81:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength >= 7) {
+                                                size_t i, KeyLength = 0;
+
+                                                sprintf_s(pOut, OutLength, "Set key: Seq %d, ", pFrame->Data[0]);
+
+                                                switch (pFrame->Data[1]) {
+                                                case 0x00:
+                                                        strcat_s(pOut, OutLength, "OFF");
+                                                        break;
+
+                                                case 0x01:
+                                                        strcat_s(pOut, OutLength, "ARC =");
+                                                        KeyLength = 5;
+                                                        break;
+
+                                                case 0x04:
+                                                        strcat_s(pOut, OutLength, "AES128 =");
+                                                        KeyLength = 16;
+                                                        break;
+
+                                                case 0x05:
+                                                        strcat_s(pOut, OutLength, "AES256 =");
+                                                        KeyLength = 32;
+                                                        break;
+                                                }
+
+                                                if (!KeyLength) {
+                                                        pOut[0] = 0;
+                                                        break;
+                                                }
+
+                                                for (i = 0; i < KeyLength && i < DataLength - 2; i++) {
+                                                        char Hex[4];
+
+                                                        sprintf_s(Hex, sizeof(Hex), " %02X", pFrame->Data[2 + i]);
+                                                        strcat_s(pOut, OutLength, Hex);
+                                                }
+                                        }
+                                }
+                                break;
+
+                        case 0x82:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        if (DataLength == 20) {
+                                                const uint32_t RX = (pFrame->Data[3] << 24) | (pFrame->Data[4] << 16) | (pFrame->Data[5] << 8) | pFrame->Data[6];
+                                                const uint32_t TX = (pFrame->Data[7] << 24) | (pFrame->Data[8] << 16) | (pFrame->Data[9] << 8) | pFrame->Data[10];
+
+                                                Event.Type = DMR_EVENT_CHANNEL;
+                                                Event.Slot = pFrame->Data[0];
+                                                Event.ColorCode = pFrame->Data[1];
+                                                Event.RxFrequency = RX;
+                                                Event.TxFrequency = TX;
+                                                FormatEvent(Event, pOut, OutLength);
+                                        }
+                                }
+                                break;
+
+                        case 0x84:
+                                if (pFrame->RW == DMR_RW_TO_DMR) {
+                                        Event.Type = DMR_EVENT_GROUP_LIST;
+                                        if (DataLength >= 5) {
+                                                size_t i;
+
+                                                for (i = 0; i < pFrame->Data[0] && i < (DataLength - 1U) / 4 && i < _countof(Event.Groups); i++) {
+                                                        Event.Groups[i] = GetId(&pFrame->Data[(i * 4) + 1]);
+                                                }
+                                                Event.Count = (uint8_t)i;
+                                        }
+                                        FormatEvent(Event, pOut, OutLength);
+                                }
+                                break;
+
+                        default:
+                                if (Decoder.pRecorder) {
+                                        RecorderTrigger(*Decoder.pRecorder, "unknown-command");
+                                }
+                                if (ProfileFrame(Decoder.pProfiler, pFrame, DataLength, Event.Time)) {
+                                        break;
+                                }
+                                QueryPerformanceCounter(&Begin);
+                                for (size_t i = 0; i < 9 + DataLength; i++) {
+                                        char Hex[4];
+                                        sprintf_s(Hex, sizeof(Hex), " %02X", pData[i]);
+                                        strcat_s(pOut, OutLength, Hex);
+                                }
+                                ProfileDump(Decoder.pProfiler, Begin);
+                                break;
+                        }
+
+                        Length = FrameLength;
+
+                        return true;
+                }
+        }
+
+        Length = 0;
+
+        return false;
+}
+
+static void PutVarint(std::vector<uint8_t> &Out, uint64_t Value)
+{
+        while (Value >= 0x80) {
+                Out.push_back((uint8_t)(Value | 0x80));
+                Value >>= 7;
+        }
+        Out.push_back((uint8_t)Value);
+}
+
+static bool GetVarint(const uint8_t *&pData, const uint8_t *pEnd, uint64_t &Value)
+{
+        uint32_t Shift = 0;
+
+        Value = 0;
+        while (pData < pEnd && Shift < 64) {
+                const uint8_t Byte = *pData++;
+
+                Value |= (uint64_t)(Byte & 0x7F) << Shift;
+                if (!(Byte & 0x80)) {
+                        return true;
+                }
+                Shift += 7;
+        }
+
+        return false;
+}
+
+static uint64_t ZigZag(int64_t Value)
+{
+        return ((uint64_t)Value << 1) ^ (uint64_t)(Value >> 63);
+}
+
+static int64_t UnZigZag(uint64_t Value)
+{
+        return (int64_t)(Value >> 1) ^ -(int64_t)(Value & 1);
+}
+
+// Byte columns are run-length coded as (value, run) pairs since most of them
+// (port, call type, color code) barely change within a block.
+static void PutByteColumn(std::vector<uint8_t> &Out, const std::vector<DMR_Event_t> &Events, size_t Offset)
+{
+        size_t i = 0;
+
+        while (i < Events.size()) {
+                const uint8_t Value = ((const uint8_t *)&Events[i])[Offset];
+                size_t Run = 1;
+
+                while (i + Run < Events.size() && ((const uint8_t *)&Events[i + Run])[Offset] == Value) {
+                        Run++;
+                }
+                Out.push_back(Value);
+                PutVarint(Out, Run);
+                i += Run;
+        }
+}
+
+static bool GetByteColumn(const uint8_t *&pData, const uint8_t *pEnd, std::vector<DMR_Event_t> &Events, size_t Offset)
+{
+        size_t i = 0;
+
+        while (i < Events.size()) {
+                uint64_t Run;
+                uint8_t Value;
+
+                if (pData >= pEnd) {
+                        return false;
+                }
+                Value = *pData++;
+                if (!GetVarint(pData, pEnd, Run) || !Run || Run > Events.size() - i) {
+                        return false;
+                }
+                while (Run--) {
+                        ((uint8_t *)&Events[i++])[Offset] = Value;
+                }
+        }
+
+        return true;
+}
+
+// Four 12 bit filter positions from one hash of the ID and its role
+static uint64_t ArchiveFilterHash(uint32_t Id, bool bDestination)
+{
+        uint64_t Hash = (((uint64_t)bDestination << 32) | Id) * 0x9E3779B97F4A7C15ULL;
+
+        Hash ^= Hash >> 29;
+        Hash *= 0xBF58476D1CE4E5B9ULL;
+
+        return Hash ^ (Hash >> 32);
+}
+
+static void ArchiveFilterAdd(DMR_ArchiveIndex_t &Index, uint32_t Id, bool bDestination)
+{
+        uint64_t Hash = ArchiveFilterHash(Id, bDestination);
+        int i;
+
+        for (i = 0; i < 4; i++, Hash >>= 12) {
+                const uint32_t Bit = (uint32_t)Hash & (ARCHIVE_FILTER_BITS - 1);
+
+                Index.Filter[Bit / 64] |= 1ULL << (Bit % 64);
+        }
+}
+
+// False only when the block certainly has no event with Id in that role
+static bool ArchiveFilterHas(const DMR_ArchiveIndex_t &Index, uint32_t Id, bool bDestination)
+{
+        uint64_t Hash = ArchiveFilterHash(Id, bDestination);
+        int i;
+
+        if (!Id) {
+                return true;
+        }
+        for (i = 0; i < 4; i++, Hash >>= 12) {
+                const uint32_t Bit = (uint32_t)Hash & (ARCHIVE_FILTER_BITS - 1);
+
+                if (!(Index.Filter[Bit / 64] & (1ULL << (Bit % 64)))) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static void ArchiveSummarize(const std::vector<DMR_Event_t> &Events, DMR_ArchiveIndex_t &Index)
+{
+        memset(&Index, 0, sizeof(Index));
+        Index.MinTime = UINT64_MAX;
+        Index.Count = (uint32_t)Events.size();
+
+        for (auto &Event : Events) {
+                ArchiveFilterAdd(Index, Event.Source, false);
+                ArchiveFilterAdd(Index, Event.Destination, true);
+                if (Event.Time < Index.MinTime) {
+                        Index.MinTime = Event.Time;
+                }
+                if (Event.Time > Index.MaxTime) {
+                        Index.MaxTime = Event.Time;
+                }
+        }
+}
+
+static void ArchiveEncodeBlock(const std::vector<DMR_Event_t> &Events, std::vector<uint8_t> &Out, DMR_ArchiveIndex_t &Index)
+{
+        std::vector<uint32_t> Dictionary;
+        uint64_t Previous;
+        uint32_t Last;
+        size_t i;
+
+        ArchiveSummarize(Events, Index);
+
+        for (auto &Event : Events) {
+                Dictionary.push_back(Event.Source);
+                Dictionary.push_back(Event.Destination);
+        }
+        std::sort(Dictionary.begin(), Dictionary.end());
+        Dictionary.erase(std::unique(Dictionary.begin(), Dictionary.end()), Dictionary.end());
+
+        // ID dictionary first, so queries can reject a block without decoding the rest
+        PutVarint(Out, Dictionary.size());
+        Last = 0;
+        for (auto Id : Dictionary) {
+                PutVarint(Out, Id - Last);
+                Last = Id;
+        }
+
+        Previous = Index.MinTime;
+        PutVarint(Out, Previous);
+        for (auto &Event : Events) {
+                PutVarint(Out, ZigZag((int64_t)(Event.Time - Previous)));
+                Previous = Event.Time;
+        }
+
+        PutByteColumn(Out, Events, offsetof(DMR_Event_t, Type));
+        PutByteColumn(Out, Events, offsetof(DMR_Event_t, Port));
+        PutByteColumn(Out, Events, offsetof(DMR_Event_t, CallType));
+        PutByteColumn(Out, Events, offsetof(DMR_Event_t, ColorCode));
+
+        for (auto &Event : Events) {
+                PutVarint(Out, std::lower_bound(Dictionary.begin(), Dictionary.end(), Event.Source) - Dictionary.begin());
+        }
+        for (auto &Event : Events) {
+                PutVarint(Out, std::lower_bound(Dictionary.begin(), Dictionary.end(), Event.Destination) - Dictionary.begin());
+        }
+
+        for (auto &Event : Events) {
+                switch (Event.Type) {
+                case DMR_EVENT_ALIAS:
+                        Out.push_back(Event.AliasFormat);
+                        Out.push_back(Event.Count);
+                        Out.insert(Out.end(), Event.Alias, Event.Alias + Event.Count);
+                        break;
+
+                case DMR_EVENT_GPS:
+                        PutVarint(Out, ZigZag(Event.Latitude));
+                        PutVarint(Out, ZigZag(Event.Longitude));
+                        break;
+
+                case DMR_EVENT_CHANNEL:
+                        Out.push_back(Event.Slot);
+                        PutVarint(Out, Event.RxFrequency);
+                        PutVarint(Out, Event.TxFrequency);
+                        break;
+
+                case DMR_EVENT_GROUP_LIST:
+                        Out.push_back(Event.Count);
+                        for (i = 0; i < Event.Count; i++) {
+                                PutVarint(Out, Event.Groups[i]);
+                        }
+                        break;
+
+                case DMR_EVENT_BUSY:
+                        Out.push_back(Event.Busy);
+                        break;
+                }
+        }
+}
+
+static bool ArchiveDecodeDictionary(const uint8_t *&pData, const uint8_t *pEnd, std::vector<uint32_t> &Dictionary)
+{
+        uint64_t Count, Value;
+        uint32_t Last = 0;
+
+        if (!GetVarint(pData, pEnd, Count) || Count > (uint64_t)(pEnd - pData)) {
+                return false;
+        }
+        Dictionary.resize((size_t)Count);
+        for (auto &Id : Dictionary) {
+                if (!GetVarint(pData, pEnd, Value)) {
+                        return false;
+                }
+                Last += (uint32_t)Value;
+                Id = Last;
+        }
+
+        return true;
+}
+
+static bool ArchiveDecodeBlock(const uint8_t *pData, const uint8_t *pEnd, const std::vector<uint32_t> &Dictionary, std::vector<DMR_Event_t> &Events)
+{
+        uint64_t Value, Previous;
+        size_t i;
+
+        if (!GetVarint(pData, pEnd, Previous)) {
+                return false;
+        }
+        for (auto &Event : Events) {
+                if (!GetVarint(pData, pEnd, Value)) {
+                        return false;
+                }
+                Previous += UnZigZag(Value);
+                Event.Time = Previous;
+        }
+
+        if (!GetByteColumn(pData, pEnd, Events, offsetof(DMR_Event_t, Type)) ||
+            !GetByteColumn(pData, pEnd, Events, offsetof(DMR_Event_t, Port)) ||
+            !GetByteColumn(pData, pEnd, Events, offsetof(DMR_Event_t, CallType)) ||
+            !GetByteColumn(pData, pEnd, Events, offsetof(DMR_Event_t, ColorCode))) {
+                return false;
+        }
+
+        for (auto &Event : Events) {
+                if (!GetVarint(pData, pEnd, Value) || Value >= Dictionary.size()) {
+                        return false;
+                }
+                Event.Source = Dictionary[(size_t)Value];
+        }
+        for (auto &Event : Events) {
+                if (!GetVarint(pData, pEnd, Value) || Value >= Dictionary.size()) {
+                        return false;
+                }
+                Event.Destination = Dictionary[(size_t)Value];
+        }
+
+        for (auto &Event : Events) {
+                uint64_t Lat, Lon;
+
+                switch (Event.Type) {
+                case DMR_EVENT_ALIAS:
+                        if (pEnd - pData < 2 || pData[1] >= sizeof(Event.Alias) || pEnd - pData < 2 + pData[1]) {
+                                return false;
+                        }
+                        Event.AliasFormat = pData[0];
+                        Event.Count = pData[1];
+                        memcpy(Event.Alias, pData + 2, Event.Count);
+                        Event.Alias[Event.Count] = 0;
+                        pData += 2 + Event.Count;
+                        break;
+
+                case DMR_EVENT_GPS:
+                        if (!GetVarint(pData, pEnd, Lat) || !GetVarint(pData, pEnd, Lon)) {
+                                return false;
+                        }
+                        Event.Latitude = (int32_t)UnZigZag(Lat);
+                        Event.Longitude = (int32_t)UnZigZag(Lon);
+                        break;
+
+                case DMR_EVENT_CHANNEL:
+                        if (pData >= pEnd) {
+                                return false;
+                        }
+                        Event.Slot = *pData++;
+                        if (!GetVarint(pData, pEnd, Value)) {
+                                return false;
+                        }
+                        Event.RxFrequency = (uint32_t)Value;
+                        if (!GetVarint(pData, pEnd, Value)) {
+                                return false;
+                        }
+                        Event.TxFrequency = (uint32_t)Value;
+                        break;
+
+                case DMR_EVENT_GROUP_LIST:
+                        if (pData >= pEnd || *pData > _countof(Event.Groups)) {
+                                return false;
+                        }
+                        Event.Count = *pData++;
+                        for (i = 0; i < Event.Count; i++) {
+                                if (!GetVarint(pData, pEnd, Value)) {
+                                        return false;
+                                }
+                                Event.Groups[i] = (uint32_t)Value;
+                        }
+                        break;
+
+                case DMR_EVENT_BUSY:
+                        if (pData >= pEnd) {
+                                return false;
+                        }
+                        Event.Busy = *pData++;
+                        break;
+                }
+        }
+
+        return true;
+}
+
+// Rolls both files back to the last complete block, so the data and the
+// index never disagree after a failed write.
+static void ArchiveTruncate(DMR_Archive_t &Archive)
+{
+        LARGE_INTEGER Size;
+
+        Size.QuadPart = Archive.Size;
+        SetFilePointerEx(Archive.hData, Size, NULL, FILE_BEGIN);
+        SetEndOfFile(Archive.hData);
+        Size.QuadPart = sizeof(DMR_ArchiveIndexHeader_t) + Archive.Entries.size() * sizeof(DMR_ArchiveIndex_t);
+        SetFilePointerEx(Archive.hIndex, Size, NULL, FILE_BEGIN);
+        SetEndOfFile(Archive.hIndex);
+}
+
+static bool ArchiveWriteIndex(DMR_Archive_t &Archive)
+{
+        const DMR_ArchiveIndexHeader_t Header = { ARCHIVE_INDEX_MAGIC, ARCHIVE_INDEX_VERSION, sizeof(DMR_ArchiveIndex_t), 0 };
+        const DWORD Length = (DWORD)(Archive.Entries.size() * sizeof(DMR_ArchiveIndex_t));
+        LARGE_INTEGER Start;
+        DWORD Written;
+
+        Start.QuadPart = 0;
+        SetFilePointerEx(Archive.hIndex, Start, NULL, FILE_BEGIN);
+        SetEndOfFile(Archive.hIndex);
+
+        return WriteFile(Archive.hIndex, &Header, sizeof(Header), &Written, NULL) && Written == sizeof(Header) &&
+                (!Length || (WriteFile(Archive.hIndex, Archive.Entries.data(), Length, &Written, NULL) && Written == Length));
+}
+
+// Indexes the complete blocks of the data file past Archive.Size, as left by an
+// index of an older version or a crash between a block and its index entry
+static size_t ArchiveRecover(DMR_Archive_t &Archive, uint64_t DataSize)
+{
+        std::vector<uint32_t> Dictionary;
+        std::vector<DMR_Event_t> Events;
+        std::vector<uint8_t> Block;
+        DMR_ArchiveBlock_t Header;
+        DMR_ArchiveIndex_t Index;
+        LARGE_INTEGER Offset;
+        size_t Recovered = 0;
+        DWORD Read;
+
+        Offset.QuadPart = Archive.Size;
+        SetFilePointerEx(Archive.hData, Offset, NULL, FILE_BEGIN);
+
+        while (DataSize - Archive.Size >= sizeof(Header)) {
+                const uint8_t *pData;
+                const uint8_t *pEnd;
+
+                if (!ReadFile(Archive.hData, &Header, sizeof(Header), &Read, NULL) || Read != sizeof(Header) ||
+                    Header.Magic != ARCHIVE_MAGIC || Header.Size > DataSize - Archive.Size - sizeof(Header) || Header.Count > Header.Size) {
+                        break;
+                }
+                Block.resize(Header.Size);
+                if (!ReadFile(Archive.hData, Block.data(), Header.Size, &Read, NULL) || Read != Header.Size || GenCheckSum(Block.data(), Header.Size) != Header.Sum) {
+                        break;
+                }
+
+                pData = Block.data();
+                pEnd = Block.data() + Block.size();
+                Events.assign(Header.Count, DMR_Event_t());
+                if (!ArchiveDecodeDictionary(pData, pEnd, Dictionary) || !ArchiveDecodeBlock(pData, pEnd, Dictionary, Events)) {
+                        break;
+                }
+
+                ArchiveSummarize(Events, Index);
+                Index.Offset = Archive.Size;
+                Index.Size = (uint32_t)(sizeof(Header) + Header.Size);
+                Archive.Entries.push_back(Index);
+                Archive.Size += Index.Size;
+                Recovered++;
+        }
+
+        return Recovered;
+}
+
+static bool ArchiveWriteBlock(DMR_Archive_t &Archive, const std::vector<DMR_Event_t> &Events)
+{
+        std::vector<uint8_t> Block(sizeof(DMR_ArchiveBlock_t));
+        DMR_ArchiveBlock_t *pHeader;
+        DMR_ArchiveIndex_t Index;
+        DWORD Written;
+
+        ArchiveEncodeBlock(Events, Block, Index);
+
+        pHeader = (DMR_ArchiveBlock_t *)Block.data();
+        pHeader->Magic = ARCHIVE_MAGIC;
+        pHeader->Count = Index.Count;
+        pHeader->Size = (uint32_t)(Block.size() - sizeof(DMR_ArchiveBlock_t));
+        pHeader->Sum = GenCheckSum(Block.data() + sizeof(DMR_ArchiveBlock_t), pHeader->Size);
+        pHeader->Reserved = 0;
+
+        Index.Offset = Archive.Size;
+        Index.Size = (uint32_t)Block.size();
+
+        // The data is written before its index entry, so a crash can at worst
+        // leave an unindexed tail that ArchiveOpen() trims away.
+        if (!WriteFile(Archive.hData, Block.data(), (DWORD)Block.size(), &Written, NULL) || Written != Block.size() ||
+            !WriteFile(Archive.hIndex, &Index, sizeof(Index), &Written, NULL) || Written != sizeof(Index)) {
+                ArchiveTruncate(Archive);
+                return false;
+        }
+
+        std::lock_guard<std::mutex> lock(Archive.Mutex);
+        Archive.Size += Block.size();
+        Archive.Entries.push_back(Index);
+
+        return true;
+}
+
+// Writer thread of the archive. Blocks stay in Archive.Queue, where queries
+// still find them, until they are written and indexed.
+static void ArchiveThread(DMR_Archive_t &Archive)
+{
+        for (;;) {
+                std::vector<DMR_Event_t> Events;
+                bool Success;
+
+                {
+                        std::unique_lock<std::mutex> lock(Archive.Mutex);
+
+                        Archive.Wake.wait(lock, [&Archive] {
+                                return Archive.bStop || Archive.Queue.size();
+                        });
+                        if (Archive.Queue.empty()) {
+                                return;
+                        }
+                        Events = Archive.Queue.front();
+                }
+
+                Success = ArchiveWriteBlock(Archive, Events);
+
+                {
+                        std::lock_guard<std::mutex> lock(Archive.Mutex);
+
+                        Archive.Queue.pop_front();
+                        if (!Success) {
+                                Archive.Lost += Events.size();
+                        }
+                }
+                Archive.Done.notify_all();
+
+                if (!Success) {
+                        char Tmp[256];
+
+                        sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to write to the archive, %zu events lost.", Events.size());
+                        AddLogMessage(Tmp);
+                }
+        }
+}
+
+// Queues the pending events as a block and waits until everything queued is written
+static void ArchiveFlush(DMR_Archive_t &Archive)
+{
+        std::unique_lock<std::mutex> lock(Archive.Mutex);
+
+        if (!Archive.Thread) {
+                return;
+        }
+        if (Archive.Pending.size()) {
+                Archive.Queue.push_back(std::move(Archive.Pending));
+                Archive.Pending.clear();
+                Archive.Wake.notify_one();
+        }
+        Archive.Done.wait(lock, [&Archive] {
+                return Archive.Queue.empty();
+        });
+}
+
+static void ArchiveAppend(DMR_Archive_t &Archive, const DMR_Event_t &Event)
+{
+        if (Event.Type == DMR_EVENT_NONE || Archive.hData == INVALID_HANDLE_VALUE) {
+                return;
+        }
+
+        std::lock_guard<std::mutex> lock(Archive.Mutex);
+
+        Archive.Pending.push_back(Event);
+        if (Archive.Pending.size() >= ARCHIVE_BLOCK_EVENTS || Event.Time - Archive.Pending[0].Time >= ARCHIVE_BLOCK_AGE) {
+                // A disk that cannot keep up loses whole blocks rather than stalling capture
+                if (Archive.Queue.size() >= ARCHIVE_QUEUE_BLOCKS) {
+                        Archive.Lost += Archive.Pending.size();
+                } else {
+                        Archive.Queue.push_back(std::move(Archive.Pending));
+                        Archive.Wake.notify_one();
+                }
+                Archive.Pending.clear();
+                Archive.Pending.reserve(ARCHIVE_BLOCK_EVENTS);
+        }
+}
+
+static void ArchiveOpen(DMR_Archive_t &Archive)
+{
+        DMR_ArchiveIndexHeader_t Header;
+        DMR_ArchiveIndex_t Index;
+        LARGE_INTEGER Size;
+        size_t Recovered;
+        bool bCurrent;
+        DWORD Read;
+
+        Archive.hData = CreateFile(Archive.pDataFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        Archive.hIndex = CreateFile(Archive.pIndexFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (Archive.hData == INVALID_HANDLE_VALUE || Archive.hIndex == INVALID_HANDLE_VALUE) {
+                AddLogMessage("Error: Failed to open the archive.");
+                if (Archive.hData != INVALID_HANDLE_VALUE) {
+                        CloseHandle(Archive.hData);
+                        Archive.hData = INVALID_HANDLE_VALUE;
+                }
+                if (Archive.hIndex != INVALID_HANDLE_VALUE) {
+                        CloseHandle(Archive.hIndex);
+                        Archive.hIndex = INVALID_HANDLE_VALUE;
+                }
+                return;
+        }
+
+        GetFileSizeEx(Archive.hData, &Size);
+
+        Archive.Size = 0;
+        Archive.Entries.clear();
+        bCurrent = ReadFile(Archive.hIndex, &Header, sizeof(Header), &Read, NULL) && Read == sizeof(Header) &&
+                Header.Magic == ARCHIVE_INDEX_MAGIC && Header.Version == ARCHIVE_INDEX_VERSION && Header.EntrySize == sizeof(DMR_ArchiveIndex_t);
+        while (bCurrent && ReadFile(Archive.hIndex, &Index, sizeof(Index), &Read, NULL) && Read == sizeof(Index)) {
+                if (Index.Offset != Archive.Size || Index.Offset + Index.Size > (uint64_t)Size.QuadPart) {
+                        break;
+                }
+                Archive.Entries.push_back(Index);
+                Archive.Size += Index.Size;
+        }
+
+        Recovered = ArchiveRecover(Archive, (uint64_t)Size.QuadPart);
+        if ((Recovered || !bCurrent) && !ArchiveWriteIndex(Archive)) {
+                AddLogMessage("Error: Failed to write the archive index.");
+        }
+        if (Recovered) {
+                char Tmp[256];
+
+                sprintf_s(Tmp, sizeof(Tmp), "Archive: indexed %zu blocks that were missing from the index.", Recovered);
+                AddLogMessage(Tmp);
+        }
+
+        // Drop anything past the last complete block
+        ArchiveTruncate(Archive);
+
+        Archive.bStop = false;
+        Archive.Thread = std::make_unique<std::thread>([&Archive] {
+                ArchiveThread(Archive);
+        });
+}
+
+static void ArchiveClose(DMR_Archive_t &Archive)
+{
+        ArchiveFlush(Archive);
+
+        if (Archive.Thread) {
+                {
+                        std::lock_guard<std::mutex> lock(Archive.Mutex);
+                        Archive.bStop = true;
+                }
+                Archive.Wake.notify_one();
+                Archive.Thread->join();
+                Archive.Thread.reset();
+        }
+
+        if (Archive.hData != INVALID_HANDLE_VALUE) {
+                CloseHandle(Archive.hData);
+                Archive.hData = INVALID_HANDLE_VALUE;
+        }
+        if (Archive.hIndex != INVALID_HANDLE_VALUE) {
+                CloseHandle(Archive.hIndex);
+                Archive.hIndex = INVALID_HANDLE_VALUE;
+        }
+}
+
+static bool ArchiveMatch(const DMR_ArchiveQuery_t &Query, const DMR_Event_t &Event)
+{
+        if (Event.Time < Query.From || Event.Time > Query.To) {
+                return false;
+        }
+        if (Query.Source && Event.Source != Query.Source) {
+                return false;
+        }
+        if (Query.Destination && Event.Destination != Query.Destination) {
+                return false;
+        }
+
+        return true;
+}
+
+static bool ArchiveHasId(const std::vector<uint32_t> &Dictionary, uint32_t Id)
+{
+        return !Id || std::binary_search(Dictionary.begin(), Dictionary.end(), Id);
+}
+
+// Calls Callback for each matching event in archive order, reading only the
+// blocks whose time range and ID filters match
+template <typename T>
+static size_t ArchiveQuery(DMR_Archive_t &Archive, const DMR_ArchiveQuery_t &Query, T Callback)
+{
+        std::vector<DMR_ArchiveIndex_t> Candidates;
+        std::vector<DMR_Event_t> Pending;
+        std::vector<uint32_t> Dictionary;
+        std::vector<DMR_Event_t> Events;
+        std::vector<uint8_t> Block;
+        size_t Scanned = 0;
+        HANDLE hFile;
+
+        {
+                std::lock_guard<std::mutex> lock(Archive.Mutex);
+
+                // Blocks are appended in time order, so the first candidate is
+                // found by binary search; the ID filters rule out most of the rest
+                auto First = std::partition_point(Archive.Entries.begin(), Archive.Entries.end(), [&Query](const DMR_ArchiveIndex_t &Entry) {
+                        return Entry.MaxTime < Query.From;
+                });
+
+                for (auto it = First; it != Archive.Entries.end() && it->MinTime <= Query.To; ++it) {
+                        if (it->MaxTime >= Query.From && ArchiveFilterHas(*it, Query.Source, false) && ArchiveFilterHas(*it, Query.Destination, true)) {
+                                Candidates.push_back(*it);
+                        }
+                }
+                for (auto &Queued : Archive.Queue) {
+                        Pending.insert(Pending.end(), Queued.begin(), Queued.end());
+                }
+                Pending.insert(Pending.end(), Archive.Pending.begin(), Archive.Pending.end());
+        }
+
+        hFile = CreateFile(Archive.pDataFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) {
+                for (auto &Entry : Candidates) {
+                        const DMR_ArchiveBlock_t *pHeader;
+                        const uint8_t *pData;
+                        const uint8_t *pEnd;
+                        LARGE_INTEGER Offset;
+                        DWORD Read;
+
+                        Block.resize(Entry.Size);
+                        Offset.QuadPart = Entry.Offset;
+                        if (!SetFilePointerEx(hFile, Offset, NULL, FILE_BEGIN) || !ReadFile(hFile, Block.data(), Entry.Size, &Read, NULL) || Read != Entry.Size) {
+                                break;
+                        }
+                        Scanned++;
+
+                        pHeader = (const DMR_ArchiveBlock_t *)Block.data();
+                        pData = Block.data() + sizeof(DMR_ArchiveBlock_t);
+                        pEnd = Block.data() + Block.size();
+                        if (pHeader->Magic != ARCHIVE_MAGIC || pHeader->Size != Entry.Size - sizeof(DMR_ArchiveBlock_t) || GenCheckSum(pData, pHeader->Size) != pHeader->Sum) {
+                                continue;
+                        }
+                        if (!ArchiveDecodeDictionary(pData, pEnd, Dictionary)) {
+                                continue;
+                        }
+                        if (!ArchiveHasId(Dictionary, Query.Source) || !ArchiveHasId(Dictionary, Query.Destination)) {
+                                continue;
+                        }
+
+                        Events.assign(pHeader->Count, DMR_Event_t());
+                        if (!ArchiveDecodeBlock(pData, pEnd, Dictionary, Events)) {
+                                continue;
+                        }
+                        for (auto &Event : Events) {
+                                if (ArchiveMatch(Query, Event)) {
+                                        Callback(Event);
+                                }
+                        }
+                }
+                CloseHandle(hFile);
+        }
+
+        for (auto &Event : Pending) {
+                if (ArchiveMatch(Query, Event)) {
+                        Callback(Event);
+                }
+        }
+
+        return Scanned;
+}
+
+static const char *GetEventName(uint8_t Type)
+{
+        static const char *const Names[] = {
+                "none", "call_start", "call_end", "detected", "alias", "gps", "channel", "group_list", "busy",
+        };
+
+        return (Type < _countof(Names)) ? Names[Type] : "unknown";
+}
+
+static void AppendJsonString(std::string &Out, const char *pText)
+{
+        Out += '"';
+        for (; *pText; pText++) {
+                const uint8_t c = (uint8_t)*pText;
+
+                if (c == '"' || c == '\\') {
+                        Out += '\\';
+                        Out += (char)c;
+                } else if (c < 0x20) {
+                        char Tmp[8];
+
+                        sprintf_s(Tmp, sizeof(Tmp), "\\u%04X", c);
+                        Out += Tmp;
+                } else {
+                        Out += (char)c;
+                }
+        }
+        Out += '"';
+}
+
+static void AppendCsvString(std::string &Out, const char *pText)
+{
+        Out += '"';
+        for (; *pText; pText++) {
+                if (*pText == '"') {
+                        Out += '"';
+                }
+                if ((uint8_t)*pText >= 0x20) {
+                        Out += *pText;
+                }
+        }
+        Out += '"';
+}
+
+static void FormatJson(const DMR_Event_t &Event, std::string &Out)
+{
+        char Tmp[256];
+        uint8_t i;
+
+        sprintf_s(Tmp, sizeof(Tmp), "{\"time\":%llu,\"type\":\"%s\",\"port\":%d", Event.Time, GetEventName(Event.Type), Event.Port);
+        Out += Tmp;
+
+        switch (Event.Type) {
+        case DMR_EVENT_CALL_START:
+        case DMR_EVENT_CALL_END:
+        case DMR_EVENT_DETECTED:
+                sprintf_s(Tmp, sizeof(Tmp), ",\"call\":\"%s\",\"source\":%u,\"destination\":%u", GetCallType(Event.CallType), Event.Source, Event.Destination);
+                Out += Tmp;
+                if (Event.Type == DMR_EVENT_DETECTED) {
+                        sprintf_s(Tmp, sizeof(Tmp), ",\"cc\":%d", Event.ColorCode);
+                        Out += Tmp;
+                }
+                break;
+
+        case DMR_EVENT_ALIAS:
+                sprintf_s(Tmp, sizeof(Tmp), ",\"source\":%u,\"format\":%d,\"alias\":", Event.Source, Event.AliasFormat);
+                Out += Tmp;
+                AppendJsonString(Out, Event.Alias);
+                break;
+
+        case DMR_EVENT_GPS:
+                sprintf_s(Tmp, sizeof(Tmp), ",\"source\":%u,\"lat\":%.6f,\"lon\":%.6f", Event.Source,
+                        (double)Event.Latitude * 180 / 16777216, (double)Event.Longitude * 360 / 33554432);
+                Out += Tmp;
+                break;
+
+        case DMR_EVENT_CHANNEL:
+                sprintf_s(Tmp, sizeof(Tmp), ",\"ts\":%d,\"cc\":%d,\"rx\":%u,\"tx\":%u", Event.Slot, Event.ColorCode, Event.RxFrequency, Event.TxFrequency);
+                Out += Tmp;
+                break;
+
+        case DMR_EVENT_GROUP_LIST:
+                Out += ",\"groups\":[";
+                for (i = 0; i < Event.Count; i++) {
+                        sprintf_s(Tmp, sizeof(Tmp), i ? ",%u" : "%u", Event.Groups[i]);
+                        Out += Tmp;
+                }
+                Out += ']';
+                break;
+
+        case DMR_EVENT_BUSY:
+                Out += Event.Busy ? ",\"busy\":true" : ",\"busy\":false";
+                break;
+        }
+
+        Out += "}\n";
+}
+
+static void FormatCsv(const DMR_Event_t &Event, std::string &Out)
+{
+        char Tmp[256];
+        uint8_t i;
+
+        sprintf_s(Tmp, sizeof(Tmp), "%llu,%s,%d,%s,%u,%u,%d,%d,%d,",
+                Event.Time, GetEventName(Event.Type), Event.Port,
+                Event.CallType ? GetCallType(Event.CallType) : "",
+                Event.Source, Event.Destination, Event.ColorCode, Event.Slot, Event.Busy);
+        Out += Tmp;
+
+        if (Event.Type == DMR_EVENT_GPS) {
+                sprintf_s(Tmp, sizeof(Tmp), "%.6f,%.6f,", (double)Event.Latitude * 180 / 16777216, (double)Event.Longitude * 360 / 33554432);
+                Out += Tmp;
+        } else {
+                Out += ",,";
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "%u,%u,", Event.RxFrequency, Event.TxFrequency);
+        Out += Tmp;
+        AppendCsvString(Out, Event.Alias);
+        Out += ',';
+        for (i = 0; i < Event.Count && Event.Type == DMR_EVENT_GROUP_LIST; i++) {
+                sprintf_s(Tmp, sizeof(Tmp), i ? " %u" : "%u", Event.Groups[i]);
+                Out += Tmp;
+        }
+        Out += "\r\n";
+}
+
+static const DMR_SinkFormat_t sinkFormats[] = {
+        { "jsonl", NULL, FormatJson },
+        { "csv", "time,type,port,call,source,destination,cc,ts,busy,lat,lon,rx,tx,alias,groups\r\n", FormatCsv },
+};
+
+static void SinkClose(DMR_Sink_t &Sink)
+{
+        std::string Final;
+
+        if (Sink.hFile == INVALID_HANDLE_VALUE) {
+                return;
+        }
+
+        // Only complete files lose the .part suffix, so whatever a reader
+        // finds without it is fully synced.
+        FlushFileBuffers(Sink.hFile);
+        CloseHandle(Sink.hFile);
+        Sink.hFile = INVALID_HANDLE_VALUE;
+
+        Final = Sink.Name.substr(0, Sink.Name.length() - 5);
+        MoveFileEx(Sink.Name.c_str(), Final.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+static bool SinkOpen(DMR_Sink_t &Sink, uint64_t Time)
+{
+        char Name[MAX_PATH];
+        time_t Now = (time_t)(Time / 1000);
+        DWORD Written;
+        tm ti;
+
+        localtime_s(&ti, &Now);
+        strftime(Name, sizeof(Name), "-%Y%m%d-%H%M%S", &ti);
+        Sink.Name = Sink.pPrefix;
+        Sink.Name += Name;
+        if (Sink.Sequence) {
+                sprintf_s(Name, sizeof(Name), "-%u", Sink.Sequence);
+                Sink.Name += Name;
+        }
+        Sink.Name += ".";
+        Sink.Name += Sink.pFormat->pExtension;
+        Sink.Name += ".part";
+
+        Sink.hFile = CreateFile(Sink.Name.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (Sink.hFile == INVALID_HANDLE_VALUE) {
+                return false;
+        }
+
+        Sink.Size = 0;
+        Sink.Opened = Time;
+        Sink.Synced = Time;
+        if (Sink.pFormat->pHeader) {
+                const DWORD Length = (DWORD)strlen(Sink.pFormat->pHeader);
+
+                if (!WriteFile(Sink.hFile, Sink.pFormat->pHeader, Length, &Written, NULL) || Written != Length) {
+                        CloseHandle(Sink.hFile);
+                        Sink.hFile = INVALID_HANDLE_VALUE;
+                        DeleteFile(Sink.Name.c_str());
+                        return false;
+                }
+                Sink.Size = Written;
+        }
+
+        return true;
+}
+
+static void SinkWrite(DMR_Sink_t &Sink, const std::string &Batch)
+{
+        const uint64_t Time = GetTimeStamp();
+        DWORD Written;
+
+        if (Sink.hFile != INVALID_HANDLE_VALUE && ((Sink.RotateSize && Sink.Size >= Sink.RotateSize) ||
+            (Sink.RotateTime && Time - Sink.Opened >= Sink.RotateTime))) {
+                SinkClose(Sink);
+                Sink.Sequence = (Time / 1000 == Sink.Opened / 1000) ? Sink.Sequence + 1 : 0;
+        }
+        if (Sink.hFile == INVALID_HANDLE_VALUE && !SinkOpen(Sink, Time)) {
+                Sink.Failed++;
+                return;
+        }
+
+        if (Batch.size()) {
+                if (!WriteFile(Sink.hFile, Batch.data(), (DWORD)Batch.size(), &Written, NULL)) {
+                        Written = 0;
+                }
+                if (Written != Batch.size()) {
+                        Sink.Failed++;
+                }
+                Sink.Size += Written;
+        }
+
+        if (Time - Sink.Synced >= Sink.SyncInterval) {
+                FlushFileBuffers(Sink.hFile);
+                Sink.Synced = Time;
+        }
+}
+
+// Swaps out the queue the capture thread appends to and writes it as one batch
+static void SinkThread(DMR_Sink_t *pSink)
+{
+        std::vector<DMR_Event_t> Events;
+        std::string Batch;
+        bool bStop = false;
+
+        while (!bStop) {
+                {
+                        std::unique_lock<std::mutex> lock(pSink->Mutex);
+
+                        pSink->Wake.wait_for(lock, std::chrono::milliseconds(SINK_BATCH_INTERVAL), [pSink] {
+                                return pSink->bStop || pSink->Queue.size() >= SINK_BATCH_EVENTS;
+                        });
+                        Events.swap(pSink->Queue);
+                        bStop = pSink->bStop;
+                }
+
+                Batch.clear();
+                for (auto &Event : Events) {
+                        pSink->pFormat->Format(Event, Batch);
+                }
+                Events.clear();
+
+                if (Batch.size() || pSink->hFile != INVALID_HANDLE_VALUE) {
+                        SinkWrite(*pSink, Batch);
+                }
+        }
+
+        SinkClose(*pSink);
+}
+
+// Returns false, counting the event as dropped, when the sink's queue is full
+static bool SinkQueue(DMR_Sink_t &Sink, const DMR_Event_t &Event)
+{
+        bool bWake;
+
+        {
+                std::lock_guard<std::mutex> lock(Sink.Mutex);
+
+                if (Sink.Queue.size() >= SINK_QUEUE_LIMIT) {
+                        Sink.Dropped++;
+                        return false;
+                }
+                Sink.Queue.push_back(Event);
+                bWake = Sink.Queue.size() == SINK_BATCH_EVENTS;
+        }
+        if (bWake) {
+                Sink.Wake.notify_one();
+        }
+
+        return true;
+}
+
+static void SinkAppend(const DMR_Event_t &Event)
+{
+        std::lock_guard<std::mutex> lock(sinkMutex);
+
+        for (auto &pSink : sinks) {
+                SinkQueue(*pSink, Event);
+        }
+}
+
+static std::unique_ptr<DMR_Sink_t> SinkCreate(const DMR_SinkFormat_t *pFormat, const char *pPrefix, uint64_t SyncInterval, uint64_t RotateSize, uint64_t RotateTime)
+{
+        std::unique_ptr<DMR_Sink_t> pSink(new DMR_Sink_t());
+
+        pSink->pFormat = pFormat;
+        pSink->pPrefix = pPrefix;
+        pSink->SyncInterval = SyncInterval;
+        pSink->RotateSize = RotateSize;
+        pSink->RotateTime = RotateTime;
+        pSink->hFile = INVALID_HANDLE_VALUE;
+        pSink->Queue.reserve(SINK_BATCH_EVENTS);
+        pSink->Thread = std::thread(SinkThread, pSink.get());
+
+        return pSink;
+}
+
+// Writes out what is queued, closes the last file and ends the sink thread
+static void SinkJoin(DMR_Sink_t &Sink)
+{
+        {
+                std::lock_guard<std::mutex> lock(Sink.Mutex);
+                Sink.bStop = true;
+        }
+        Sink.Wake.notify_one();
+        Sink.Thread.join();
+}
+
+static void SinkStart(const DMR_SinkFormat_t *pFormat, uint64_t SyncInterval, uint64_t RotateSize, uint64_t RotateTime)
+{
+        std::unique_ptr<DMR_Sink_t> pSink = SinkCreate(pFormat, SINK_PREFIX, SyncInterval, RotateSize, RotateTime);
+
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        sinks.push_back(std::move(pSink));
+}
+
+static void SinkStop(const DMR_SinkFormat_t *pFormat)
+{
+        std::vector<std::unique_ptr<DMR_Sink_t>> Stopped;
+
+        {
+                std::lock_guard<std::mutex> lock(sinkMutex);
+
+                for (auto it = sinks.begin(); it != sinks.end();) {
+                        if (!pFormat || (*it)->pFormat == pFormat) {
+                                Stopped.push_back(std::move(*it));
+                                it = sinks.erase(it);
+                        } else {
+                                ++it;
+                        }
+                }
+        }
+
+        for (auto &pSink : Stopped) {
+                char Tmp[256];
+
+                SinkJoin(*pSink);
+
+                sprintf_s(Tmp, sizeof(Tmp), "Stopped %s export (%llu events dropped, %llu write errors).", pSink->pFormat->pExtension, pSink->Dropped, pSink->Failed);
+                AddLogMessage(Tmp);
+        }
+}
+
+template <typename T>
+static void PutValue(std::vector<uint8_t> &Out, T Value)
+{
+        const uint8_t *pValue = (const uint8_t *)&Value;
+
+        Out.insert(Out.end(), pValue, pValue + sizeof(Value));
+}
+
+// Little-endian uint16_t length, the common header, then the fields of the event type
+static void EncodeEvent(const DMR_Event_t &Event, std::vector<uint8_t> &Out)
+{
+        uint8_t i;
+
+        Out.clear();
+        PutValue<uint16_t>(Out, 0);
+        PutValue(Out, Event.Time);
+        PutValue(Out, Event.Type);
+        PutValue(Out, Event.Port);
+        PutValue(Out, Event.CallType);
+        PutValue(Out, Event.ColorCode);
+        PutValue(Out, Event.Source);
+        PutValue(Out, Event.Destination);
+
+        switch (Event.Type) {
+        case DMR_EVENT_ALIAS:
+                PutValue(Out, Event.AliasFormat);
+                PutValue(Out, Event.Count);
+                Out.insert(Out.end(), Event.Alias, Event.Alias + Event.Count);
+                break;
+
+        case DMR_EVENT_GPS:
+                PutValue(Out, Event.Latitude);
+                PutValue(Out, Event.Longitude);
+                break;
+
+        case DMR_EVENT_CHANNEL:
+                PutValue(Out, Event.Slot);
+                PutValue(Out, Event.RxFrequency);
+                PutValue(Out, Event.TxFrequency);
+                break;
+
+        case DMR_EVENT_GROUP_LIST:
+                PutValue(Out, Event.Count);
+                for (i = 0; i < Event.Count; i++) {
+                        PutValue(Out, Event.Groups[i]);
+                }
+                break;
+
+        case DMR_EVENT_BUSY:
+                PutValue(Out, Event.Busy);
+                break;
+        }
+
+        *(uint16_t *)Out.data() = (uint16_t)(Out.size() - 2);
+}
+
+static bool ParseFilter(const std::string &Request, DMR_Subscriber_t &Subscriber)
+{
+        size_t Start = 0;
+
+        Subscriber.Filter.Types = UINT32_MAX;
+        Subscriber.Filter.Source = 0;
+        Subscriber.Filter.Destination = 0;
+        Subscriber.Filter.ColorCode = -1;
+        Subscriber.bText = false;
+
+        while (Start < Request.length()) {
+                size_t End = Request.find(' ', Start);
+                std::string Arg;
+
+                if (End == std::string::npos) {
+                        End = Request.length();
+                }
+                Arg = Request.substr(Start, End - Start);
+                Start = End + 1;
+
+                if (Arg.empty() || Arg == "binary") {
+                        continue;
+                } else if (Arg == "text") {
+                        Subscriber.bText = true;
+                } else if (!Arg.compare(0, 6, "types=")) {
+                        size_t Pos = 6;
+
+                        Subscriber.Filter.Types = 0;
+                        while (Pos < Arg.length()) {
+                                size_t Comma = Arg.find(',', Pos);
+                                std::string Name;
+                                uint8_t Type;
+
+                                if (Comma == std::string::npos) {
+                                        Comma = Arg.length();
+                                }
+                                Name = Arg.substr(Pos, Comma - Pos);
+                                Pos = Comma + 1;
+                                for (Type = DMR_EVENT_CALL_START; Type <= DMR_EVENT_BUSY; Type++) {
+                                        if (Name == GetEventName(Type)) {
+                                                Subscriber.Filter.Types |= 1U << Type;
+                                                break;
+                                        }
+                                }
+                                if (Type > DMR_EVENT_BUSY) {
+                                        return false;
+                                }
+                        }
+                } else if (!Arg.compare(0, 4, "src=")) {
+                        Subscriber.Filter.Source = strtoul(Arg.c_str() + 4, NULL, 10);
+                } else if (!Arg.compare(0, 4, "dst=")) {
+                        Subscriber.Filter.Destination = strtoul(Arg.c_str() + 4, NULL, 10);
+                } else if (!Arg.compare(0, 3, "cc=")) {
+                        Subscriber.Filter.ColorCode = atoi(Arg.c_str() + 3);
+                } else {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static bool MatchFilter(const DMR_Filter_t &Filter, const DMR_Event_t &Event)
+{
+        if (!(Filter.Types & (1U << Event.Type))) {
+                return false;
+        }
+        if (Filter.Source && Event.Source != Filter.Source) {
+                return false;
+        }
+        if (Filter.Destination && Event.Destination != Filter.Destination) {
+                return false;
+        }
+        if (Filter.ColorCode >= 0 && (Event.Type == DMR_EVENT_DETECTED || Event.Type == DMR_EVENT_CHANNEL) && Event.ColorCode != Filter.ColorCode) {
+                return false;
+        }
+
+        return true;
+}
+
+static void PublisherDisconnect(DMR_Subscriber_t &Subscriber, const char *pReason)
+{
+        char Tmp[256];
+
+        sprintf_s(Tmp, sizeof(Tmp), "Subscriber %s disconnected: %s (%llu sent, %llu dropped).", Subscriber.Name.c_str(), pReason, Subscriber.Sent, Subscriber.Dropped);
+        AddLogMessage(Tmp);
+
+        closesocket(Subscriber.Socket);
+        Subscriber.Socket = INVALID_SOCKET;
+}
+
+static void PublisherAccept(SOCKET Listener)
+{
+        std::unique_ptr<DMR_Subscriber_t> pSubscriber;
+        sockaddr_storage Address;
+        int Length = sizeof(Address);
+        u_long NonBlocking = 1;
+        char Tmp[256];
+        SOCKET Socket;
+
+        Socket = accept(Listener, (sockaddr *)&Address, &Length);
+        if (Socket == INVALID_SOCKET) {
+                return;
+        }
+        if (subscribers.size() >= PUBLISH_MAX_SUBSCRIBERS) {
+                closesocket(Socket);
+                return;
+        }
+        ioctlsocket(Socket, FIONBIO, &NonBlocking);
+
+        pSubscriber.reset(new DMR_Subscriber_t());
+        pSubscriber->Socket = Socket;
+        pSubscriber->Connected = GetTickCount64();
+        if (Address.ss_family == AF_INET) {
+                const sockaddr_in *pAddress = (const sockaddr_in *)&Address;
+
+                inet_ntop(AF_INET, &pAddress->sin_addr, Tmp, sizeof(Tmp));
+                pSubscriber->Name = Tmp;
+                sprintf_s(Tmp, sizeof(Tmp), ":%d", ntohs(pAddress->sin_port));
+                pSubscriber->Name += Tmp;
+        } else {
+                pSubscriber->Name = PUBLISH_UNIX_PATH;
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "Subscriber %s connected.", pSubscriber->Name.c_str());
+        AddLogMessage(Tmp);
+
+        std::lock_guard<std::mutex> lock(subscriberMutex);
+        subscribers.push_back(std::move(pSubscriber));
+}
+
+static void PublisherReceive(DMR_Subscriber_t &Subscriber)
+{
+        char Buffer[256];
+        int Received;
+
+        Received = recv(Subscriber.Socket, Buffer, sizeof(Buffer), 0);
+        if (Received <= 0) {
+                if (Received == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
+                        PublisherDisconnect(Subscriber, "closed by peer");
+                }
+                return;
+        }
+        if (Subscriber.bSubscribed) {
+                return;
+        }
+
+        // The first line sent by a subscriber selects the mode and filter
+        Subscriber.Request.append(Buffer, Received);
+        size_t End = Subscriber.Request.find('\n');
+        if (End == std::string::npos) {
+                if (Subscriber.Request.length() > 1024) {
+                        PublisherDisconnect(Subscriber, "request too long");
+                }
+                return;
+        }
+
+        Subscriber.Request.resize(End);
+        if (Subscriber.Request.length() && Subscriber.Request.back() == '\r') {
+                Subscriber.Request.pop_back();
+        }
+        if (!ParseFilter(Subscriber.Request, Subscriber)) {
+                PublisherDisconnect(Subscriber, "invalid filter");
+                return;
+        }
+        Subscriber.bSubscribed = true;
+}
+
+// Queued messages are coalesced into one send() of up to PUBLISH_SEND_BATCH
+// bytes, and latency is accounted once the whole batch has left.
+static void PublisherSend(DMR_Subscriber_t &Subscriber)
+{
+        LARGE_INTEGER Now;
+        int Sent;
+
+        for (;;) {
+                if (Subscriber.Offset == Subscriber.Output.size()) {
+                        Subscriber.Output.clear();
+                        Subscriber.OutputTicks.clear();
+                        Subscriber.Offset = 0;
+
+                        while (Subscriber.Queue.size() && Subscriber.Output.size() < PUBLISH_SEND_BATCH) {
+                                const DMR_Message_t &Message = *Subscriber.Queue.front();
+
+                                if (Subscriber.bText) {
+                                        Subscriber.Output += Message.Text;
+                                } else {
+                                        Subscriber.Output.append((const char *)Message.Binary.data(), Message.Binary.size());
+                                }
+                                Subscriber.OutputTicks.push_back(Message.Ticks);
+                                Subscriber.Queue.pop_front();
+                        }
+                        if (Subscriber.Output.empty()) {
+                                return;
+                        }
+                }
+
+                Sent = send(Subscriber.Socket, Subscriber.Output.data() + Subscriber.Offset, (int)(Subscriber.Output.size() - Subscriber.Offset), 0);
+                if (Sent <= 0) {
+                        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                                PublisherDisconnect(Subscriber, "send failed");
+                        }
+                        return;
+                }
+
+                Subscriber.Offset += Sent;
+                if (Subscriber.Offset < Subscriber.Output.size()) {
+                        return;
+                }
+
+                QueryPerformanceCounter(&Now);
+                for (auto Ticks : Subscriber.OutputTicks) {
+                        Subscriber.Latency += Now.QuadPart - Ticks;
+                        if (Now.QuadPart - Ticks > Subscriber.MaxLatency) {
+                                Subscriber.MaxLatency = Now.QuadPart - Ticks;
+                        }
+                }
+                Subscriber.Sent += Subscriber.OutputTicks.size();
+                Subscriber.FullSince = 0;
+        }
+}
+
+static void PublisherFanOut(void)
+{
+        std::vector<std::shared_ptr<DMR_Message_t>> Messages;
+        bool bText = false;
+
+        {
+                std::lock_guard<std::mutex> lock(publishMutex);
+                Messages.swap(publishInbox);
+        }
+        if (Messages.empty()) {
+                return;
+        }
+
+        for (auto &pSubscriber : subscribers) {
+                bText |= pSubscriber->bText;
+        }
+
+        for (auto &pMessage : Messages) {
+                EncodeEvent(pMessage->Event, pMessage->Binary);
+                if (bText) {
+                        FormatJson(pMessage->Event, pMessage->Text);
+                }
+
+                for (auto &pSubscriber : subscribers) {
+                        if (!pSubscriber->bSubscribed || pSubscriber->Socket == INVALID_SOCKET || !MatchFilter(pSubscriber->Filter, pMessage->Event)) {
+                                continue;
+                        }
+                        // Drop events while a subscriber's queue is full, and drop the
+                        // subscriber once it has not caught up for PUBLISH_SLOW_TIMEOUT
+                        if (pSubscriber->Queue.size() >= PUBLISH_QUEUE_LIMIT) {
+                                pSubscriber->Dropped++;
+                                if (!pSubscriber->FullSince) {
+                                        pSubscriber->FullSince = GetTickCount64();
+                                } else if (GetTickCount64() - pSubscriber->FullSince >= PUBLISH_SLOW_TIMEOUT) {
+                                        PublisherDisconnect(*pSubscriber, "too slow");
+                                }
+                                continue;
+                        }
+                        pSubscriber->Queue.push_back(pMessage);
+                }
+        }
+}
+
+// Publisher thread. Owns every socket; the capture thread only posts events
+// to publishInbox and pokes the wake socket when the inbox was empty.
+static void PublisherThread(void)
+{
+        char Buffer[64];
+
+        while (!publishStop) {
+                fd_set Read, Write;
+                timeval Timeout = { 1, 0 };
+
+                FD_ZERO(&Read);
+                FD_ZERO(&Write);
+                FD_SET(publishWake, &Read);
+                if (publishTcp != INVALID_SOCKET) {
+                        FD_SET(publishTcp, &Read);
+                }
+                if (publishUnix != INVALID_SOCKET) {
+                        FD_SET(publishUnix, &Read);
+                }
+                for (auto &pSubscriber : subscribers) {
+                        FD_SET(pSubscriber->Socket, &Read);
+                        if (pSubscriber->Queue.size() || pSubscriber->Offset < pSubscriber->Output.size()) {
+                                FD_SET(pSubscriber->Socket, &Write);
+                        }
+                }
+
+                if (select(0, &Read, &Write, NULL, &Timeout) == SOCKET_ERROR) {
+                        Sleep(10);
+                        continue;
+                }
+
+                if (FD_ISSET(publishWake, &Read)) {
+                        while (recv(publishWake, Buffer, sizeof(Buffer), 0) > 0) {
+                        }
+                }
+                if (publishTcp != INVALID_SOCKET && FD_ISSET(publishTcp, &Read)) {
+                        PublisherAccept(publishTcp);
+                }
+                if (publishUnix != INVALID_SOCKET && FD_ISSET(publishUnix, &Read)) {
+                        PublisherAccept(publishUnix);
+                }
+
+                {
+                        std::lock_guard<std::mutex> lock(subscriberMutex);
+
+                        for (auto &pSubscriber : subscribers) {
+                                if (pSubscriber->Socket != INVALID_SOCKET && FD_ISSET(pSubscriber->Socket, &Read)) {
+                                        PublisherReceive(*pSubscriber);
+                                }
+                                // A connection that never subscribes would otherwise hold its slot for good
+                                if (pSubscriber->Socket != INVALID_SOCKET && !pSubscriber->bSubscribed &&
+                                    GetTickCount64() - pSubscriber->Connected >= PUBLISH_REQUEST_TIMEOUT) {
+                                        PublisherDisconnect(*pSubscriber, "no request");
+                                }
+                        }
+
+                        PublisherFanOut();
+
+                        for (auto &pSubscriber : subscribers) {
+                                if (pSubscriber->Socket != INVALID_SOCKET && (pSubscriber->Queue.size() || pSubscriber->Offset < pSubscriber->Output.size())) {
+                                        PublisherSend(*pSubscriber);
+                                }
+                        }
+
+                        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](const std::unique_ptr<DMR_Subscriber_t> &pSubscriber) {
+                                return pSubscriber->Socket == INVALID_SOCKET;
+                        }), subscribers.end());
+                }
+        }
+
+        std::lock_guard<std::mutex> lock(subscriberMutex);
+        for (auto &pSubscriber : subscribers) {
+                closesocket(pSubscriber->Socket);
+        }
+        subscribers.clear();
+}
+
+static void PublishEvent(const DMR_Event_t &Event)
+{
+        std::shared_ptr<DMR_Message_t> pMessage;
+        LARGE_INTEGER Now;
+
+        if (!bPublishing) {
+                return;
+        }
+
+        QueryPerformanceCounter(&Now);
+        pMessage = std::make_shared<DMR_Message_t>();
+        pMessage->Event = Event;
+        pMessage->Ticks = Now.QuadPart;
+
+        // bPublishing is checked again under the lock, as PublisherStop() clears
+        // it there before the poke socket is closed.
+        std::lock_guard<std::mutex> lock(publishMutex);
+
+        if (!bPublishing) {
+                return;
+        }
+        if (publishInbox.size() >= PUBLISH_INBOX_LIMIT) {
+                publishDropped++;
+                return;
+        }
+        publishInbox.push_back(pMessage);
+        if (publishInbox.size() == 1) {
+                sendto(publishPoke, "", 1, 0, (const sockaddr *)&publishWakeAddress, sizeof(publishWakeAddress));
+        }
+}
+
+static SOCKET PublisherListen(int Family, const sockaddr *pAddress, int Length)
+{
+        SOCKET Socket;
+
+        Socket = socket(Family, SOCK_STREAM, 0);
+        if (Socket == INVALID_SOCKET) {
+                return INVALID_SOCKET;
+        }
+        if (bind(Socket, pAddress, Length) == SOCKET_ERROR || listen(Socket, SOMAXCONN) == SOCKET_ERROR) {
+                closesocket(Socket);
+                return INVALID_SOCKET;
+        }
+
+        return Socket;
+}
+
+// Listens on the loopback interface unless another local address (0.0.0.0 for
+// all of them) is given, as subscribers get every event unauthenticated.
+static void PublisherStart(uint16_t Port, const char *pBindAddress)
+{
+        sockaddr_in Address;
+        sockaddr_un UnixAddress;
+        u_long NonBlocking = 1;
+        int Length = sizeof(publishWakeAddress);
+        int AddressLength = sizeof(Address);
+        char Tmp[256];
+
+        if (publishThread) {
+                return;
+        }
+
+        memset(&Address, 0, sizeof(Address));
+        Address.sin_family = AF_INET;
+        Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Address.sin_port = htons(Port);
+        if (pBindAddress && inet_pton(AF_INET, pBindAddress, &Address.sin_addr) != 1) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Invalid bind address '%s'.", pBindAddress);
+                AddLogMessage(Tmp);
+                return;
+        }
+        publishTcp = PublisherListen(AF_INET, (const sockaddr *)&Address, sizeof(Address));
+        if (publishTcp == INVALID_SOCKET) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to listen on TCP port %d (%d).", Port, WSAGetLastError());
+                AddLogMessage(Tmp);
+                return;
+        }
+        publishPort = (getsockname(publishTcp, (sockaddr *)&Address, &AddressLength) == SOCKET_ERROR) ? Port : ntohs(Address.sin_port);
+
+        // Unix domain sockets need Windows 10 1803 or later, so they are optional
+        memset(&UnixAddress, 0, sizeof(UnixAddress));
+        UnixAddress.sun_family = AF_UNIX;
+        strcpy_s(UnixAddress.sun_path, sizeof(UnixAddress.sun_path), PUBLISH_UNIX_PATH);
+        DeleteFile(PUBLISH_UNIX_PATH);
+        publishUnix = PublisherListen(AF_UNIX, (const sockaddr *)&UnixAddress, sizeof(UnixAddress));
+
+        Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Address.sin_port = 0;
+        publishWake = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        publishPoke = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (publishWake == INVALID_SOCKET || publishPoke == INVALID_SOCKET ||
+            bind(publishWake, (const sockaddr *)&Address, sizeof(Address)) == SOCKET_ERROR ||
+            getsockname(publishWake, (sockaddr *)&publishWakeAddress, &Length) == SOCKET_ERROR ||
+            ioctlsocket(publishWake, FIONBIO, &NonBlocking) == SOCKET_ERROR) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create the publisher wake socket (%d).", WSAGetLastError());
+                AddLogMessage(Tmp);
+                if (publishWake != INVALID_SOCKET) {
+                        closesocket(publishWake);
+                        publishWake = INVALID_SOCKET;
+                }
+                if (publishPoke != INVALID_SOCKET) {
+                        closesocket(publishPoke);
+                        publishPoke = INVALID_SOCKET;
+                }
+                closesocket(publishTcp);
+                publishTcp = INVALID_SOCKET;
+                if (publishUnix != INVALID_SOCKET) {
+                        closesocket(publishUnix);
+                        publishUnix = INVALID_SOCKET;
+                        DeleteFile(PUBLISH_UNIX_PATH);
+                }
+                return;
+        }
+
+        publishStop = false;
+        publishThread = std::make_unique<std::thread>(PublisherThread);
+        {
+                std::lock_guard<std::mutex> lock(publishMutex);
+                bPublishing = true;
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "Publishing events on %s TCP port %d%s.", pBindAddress ? pBindAddress : "loopback", publishPort,
+                (publishUnix != INVALID_SOCKET) ? " and " PUBLISH_UNIX_PATH : "");
+        AddLogMessage(Tmp);
+}
+
+static void PublisherStop(void)
+{
+        if (!publishThread) {
+                return;
+        }
+
+        // Once bPublishing is cleared under the lock no PublishEvent() can
+        // touch the poke socket any more, so it is safe to close below.
+        {
+                std::lock_guard<std::mutex> lock(publishMutex);
+                bPublishing = false;
+        }
+        publishStop = true;
+        sendto(publishPoke, "", 1, 0, (const sockaddr *)&publishWakeAddress, sizeof(publishWakeAddress));
+        publishThread->join();
+        publishThread.reset();
+
+        closesocket(publishTcp);
+        publishTcp = INVALID_SOCKET;
+        if (publishUnix != INVALID_SOCKET) {
+                closesocket(publishUnix);
+                publishUnix = INVALID_SOCKET;
+                DeleteFile(PUBLISH_UNIX_PATH);
+        }
+        closesocket(publishWake);
+        publishWake = INVALID_SOCKET;
+        closesocket(publishPoke);
+        publishPoke = INVALID_SOCKET;
+
+        std::lock_guard<std::mutex> lock(publishMutex);
+        publishInbox.clear();
+}
+
+static void PublisherReport(void)
+{
+        LARGE_INTEGER Frequency;
+        char Tmp[256];
+
+        QueryPerformanceFrequency(&Frequency);
+
+        sprintf_s(Tmp, sizeof(Tmp), "Publisher: %s, %llu events dropped before fan-out.", publishThread ? "running" : "stopped", publishDropped);
+        AddLogMessage(Tmp);
+
+        std::lock_guard<std::mutex> lock(subscriberMutex);
+        for (auto &pSubscriber : subscribers) {
+                sprintf_s(Tmp, sizeof(Tmp), "  %s %s: %llu sent, %llu dropped, %zu queued, latency avg %.3f ms max %.3f ms",
+                        pSubscriber->Name.c_str(), pSubscriber->bText ? "text" : "binary",
+                        pSubscriber->Sent, pSubscriber->Dropped, pSubscriber->Queue.size(),
+                        pSubscriber->Sent ? (double)pSubscriber->Latency * 1000.0 / Frequency.QuadPart / pSubscriber->Sent : 0.0,
+                        (double)pSubscriber->MaxLatency * 1000.0 / Frequency.QuadPart);
+                AddLogMessage(Tmp);
+        }
+}
+
+// Shared ring of the latest events: a DMR_RingHeader_t then SlotCount slots,
+// record N in slot (N - 1) % SlotCount. See RingRead() for the reader side.
+static void RingClose(void)
+{
+        if (pRing) {
+                UnmapViewOfFile(pRing);
+                pRing = NULL;
+        }
+        if (hRing) {
+                CloseHandle(hRing);
+                hRing = NULL;
+        }
+        if (hRingMutex) {
+                ReleaseMutex(hRingMutex);
+                CloseHandle(hRingMutex);
+                hRingMutex = NULL;
+        }
+}
+
+static bool RingOpen(void)
+{
+        const uint64_t Size = sizeof(DMR_RingHeader_t) + (uint64_t)RING_SLOT_COUNT * sizeof(DMR_RingSlot_t);
+        bool bExisting;
+        DWORD Wait;
+        char Tmp[256];
+
+        // Only one instance writes; Windows releases the mutex if its owner dies
+        hRingMutex = CreateMutex(NULL, FALSE, RING_MUTEX_NAME);
+        if (!hRingMutex) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create the event ring mutex (0x%08X).", GetLastError());
+                AddLogMessage(Tmp);
+                return false;
+        }
+        Wait = WaitForSingleObject(hRingMutex, 0);
+        if (Wait != WAIT_OBJECT_0 && Wait != WAIT_ABANDONED) {
+                AddLogMessage("Event ring is owned by another instance, not publishing to it.");
+                CloseHandle(hRingMutex);
+                hRingMutex = NULL;
+                return false;
+        }
+
+        hRing = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(Size >> 32), (DWORD)Size, RING_NAME);
+        if (!hRing) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create the event ring (0x%08X).", GetLastError());
+                AddLogMessage(Tmp);
+                RingClose();
+                return false;
+        }
+        bExisting = GetLastError() == ERROR_ALREADY_EXISTS;
+
+        pRing = (DMR_RingHeader_t *)MapViewOfFile(hRing, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)Size);
+        if (!pRing) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to map the event ring (0x%08X).", GetLastError());
+                AddLogMessage(Tmp);
+                RingClose();
+                return false;
+        }
+
+        // Readers keep the section of an earlier run alive; carry on from its Head
+        if (bExisting && pRing->Magic) {
+                if (pRing->Magic != RING_MAGIC || pRing->Version != RING_VERSION || pRing->SlotCount != RING_SLOT_COUNT || pRing->SlotSize != sizeof(DMR_RingSlot_t)) {
+                        AddLogMessage("Error: The existing event ring has a different layout, not publishing to it.");
+                        RingClose();
+                        return false;
+                }
+                sprintf_s(Tmp, sizeof(Tmp), "Event ring: continuing after record %llu.", pRing->Head.load(std::memory_order_relaxed));
+                AddLogMessage(Tmp);
+                return true;
+        }
+
+        // A new section starts zeroed, so only the geometry needs filling in
+        pRing->Magic = RING_MAGIC;
+        pRing->Version = RING_VERSION;
+        pRing->SlotCount = RING_SLOT_COUNT;
+        pRing->SlotSize = sizeof(DMR_RingSlot_t);
+
+        return true;
+}
+
+static void RingWrite(DMR_RingHeader_t *pHeader, const DMR_Event_t &Event, const uint8_t *pFrame, size_t FrameLength)
+{
+        uint64_t Sequence;
+        DMR_RingSlot_t *pSlot;
+
+        if (!pHeader) {
+                return;
+        }
+
+        Sequence = pHeader->Head.load(std::memory_order_relaxed) + 1;
+        pSlot = &((DMR_RingSlot_t *)(pHeader + 1))[(Sequence - 1) % RING_SLOT_COUNT];
+
+        pSlot->Sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        pSlot->Record.Event = Event;
+        pSlot->Record.FrameLength = (uint16_t)FrameLength;
+        memcpy(pSlot->Record.Frame, pFrame, FrameLength);
+
+        pSlot->Sequence.store(Sequence, std::memory_order_release);
+        pHeader->Head.store(Sequence, std::memory_order_release);
+}
+
+// Copies record *pNext into Record and advances *pNext, false when there is
+// none yet. Lost is the number of records the writer lapped the reader by.
+static bool RingRead(const DMR_RingHeader_t *pHeader, uint64_t *pNext, DMR_RingRecord_t &Record, uint64_t &Lost)
+{
+        const DMR_RingSlot_t *pSlots = (const DMR_RingSlot_t *)(pHeader + 1);
+
+        Lost = 0;
+        for (;;) {
+                const uint64_t Head = pHeader->Head.load(std::memory_order_acquire);
+                const DMR_RingSlot_t *pSlot;
+                uint64_t Before, After;
+
+                if (*pNext == 0) {
+                        *pNext = Head + 1;
+                }
+                if (*pNext > Head) {
+                        return false;
+                }
+                if (Head - *pNext >= pHeader->SlotCount) {
+                        Lost += Head - pHeader->SlotCount + 1 - *pNext;
+                        *pNext = Head - pHeader->SlotCount + 1;
+                }
+
+                pSlot = &pSlots[(*pNext - 1) % pHeader->SlotCount];
+                Before = pSlot->Sequence.load(std::memory_order_acquire);
+                Record = pSlot->Record;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                After = pSlot->Sequence.load(std::memory_order_relaxed);
+
+                if (Before == *pNext && After == *pNext) {
+                        (*pNext)++;
+                        return true;
+                }
+
+                // Overwritten while reading, skip ahead on the next pass
+                Lost++;
+                (*pNext)++;
+        }
+}
+
+static void RingReport(void)
+{
+        DMR_RingRecord_t Record;
+        uint64_t Next, Lost;
+        char Tmp[512];
+        char Msg[512];
+
+        if (!pRing) {
+                AddLogMessage("Event ring: not available.");
+                return;
+        }
+
+        Next = pRing->Head.load(std::memory_order_acquire);
+        sprintf_s(Tmp, sizeof(Tmp), "Event ring %s: %llu records written, %u slots of %u bytes.", RING_NAME, Next, pRing->SlotCount, pRing->SlotSize);
+        AddLogMessage(Tmp);
+
+        if (Next && RingRead(pRing, &Next, Record, Lost)) {
+                FormatEvent(Record.Event, Msg, sizeof(Msg));
+                sprintf_s(Tmp, sizeof(Tmp), "Last record: command 0x%02X, %d frame bytes%s%s", Record.Event.Command, Record.FrameLength, Msg[0] ? ", " : "", Msg);
+                AddLogMessage(Tmp);
+        }
+}
+
+// Per minute buckets for the sliding hour and counts of the current and previous hour, per key
+static const char *analyticsNames[DMR_ANALYTICS_DIMENSIONS] = { "Talkgroup", "Source", "CC", "TS", "Port" };
+static const char *analyticsArgs[DMR_ANALYTICS_DIMENSIONS] = { "tg", "src", "cc", "ts", "port" };
+
+static void AnalyticsAccumulate(DMR_AnalyticsCount_t &Count, const DMR_AnalyticsCount_t &Delta)
+{
+        Count.Calls += Delta.Calls;
+        Count.Detected += Delta.Detected;
+        Count.Airtime += Delta.Airtime;
+        Count.Busy += Delta.Busy;
+}
+
+static void AnalyticsAdd(DMR_AnalyticsKey_t &Key, uint64_t Time, const DMR_AnalyticsCount_t &Delta)
+{
+        const uint32_t Index = (uint32_t)(Time / ANALYTICS_BUCKET_TIME);
+        const uint32_t Period = (uint32_t)(Time / ANALYTICS_PERIOD);
+        DMR_AnalyticsBucket_t &Bucket = Key.Bucket[Index % ANALYTICS_BUCKETS];
+
+        if (Bucket.Index < Index) {
+                memset(&Bucket.Count, 0, sizeof(Bucket.Count));
+                Bucket.Index = Index;
+        }
+        if (Bucket.Index == Index) {
+                AnalyticsAccumulate(Bucket.Count, Delta);
+        }
+
+        if (Period > Key.Period) {
+                if (Period == Key.Period + 1) {
+                        Key.Previous = Key.Current;
+                } else {
+                        memset(&Key.Previous, 0, sizeof(Key.Previous));
+                }
+                memset(&Key.Current, 0, sizeof(Key.Current));
+                Key.Period = Period;
+        }
+        if (Period == Key.Period) {
+                AnalyticsAccumulate(Key.Current, Delta);
+        } else if (Period + 1 == Key.Period) {
+                AnalyticsAccumulate(Key.Previous, Delta);
+        }
+}
+
+// Returns the key, creating it if needed. When the table is full, keys that
+// have nothing left in either window are dropped, at most once a bucket.
+static DMR_AnalyticsKey_t *AnalyticsFind(DMR_Analytics_t &Analytics, uint64_t Key, uint64_t Time)
+{
+        auto it = Analytics.Keys.find(Key);
+
+        if (it == Analytics.Keys.end()) {
+                if (Analytics.Keys.size() >= ANALYTICS_MAX_KEYS && Time >= Analytics.LastSweep + ANALYTICS_BUCKET_TIME) {
+                        for (auto Old = Analytics.Keys.begin(); Old != Analytics.Keys.end();) {
+                                if (Old->second.LastTime + ANALYTICS_SPAN_LIMIT < Time) {
+                                        Old = Analytics.Keys.erase(Old);
+                                } else {
+                                        ++Old;
+                                }
+                        }
+                        Analytics.LastSweep = Time;
+                }
+                if (Analytics.Keys.size() >= ANALYTICS_MAX_KEYS) {
+                        Analytics.Dropped++;
+                        return NULL;
+                }
+                it = Analytics.Keys.emplace(Key, DMR_AnalyticsKey_t()).first;
+        }
+        if (Time > it->second.LastTime) {
+                it->second.LastTime = Time;
+        }
+
+        return &it->second;
+}
+
+// Collects the keys a call (or, without bCall, a busy period) on the channel counts towards
+static size_t AnalyticsKeys(const DMR_AnalyticsChannel_t &Channel, uint8_t Port, bool bCall, uint64_t *pKeys)
+{
+        size_t Count = 0;
+
+        if (bCall) {
+                if (Channel.CallType != 0x01) {
+                        pKeys[Count++] = ((uint64_t)DMR_ANALYTICS_TALKGROUP << 32) | Channel.Destination;
+                }
+                pKeys[Count++] = ((uint64_t)DMR_ANALYTICS_SOURCE << 32) | Channel.Source;
+        }
+        if (Channel.bColorCode) {
+                pKeys[Count++] = ((uint64_t)DMR_ANALYTICS_COLOR_CODE << 32) | Channel.ColorCode;
+        }
+        if (Channel.bSlot) {
+                pKeys[Count++] = ((uint64_t)DMR_ANALYTICS_SLOT << 32) | Channel.Slot;
+        }
+        pKeys[Count++] = ((uint64_t)DMR_ANALYTICS_PORT << 32) | Port;
+
+        return Count;
+}
+
+static void AnalyticsCount(DMR_Analytics_t &Analytics, const uint64_t *pKeys, size_t Count, uint64_t Time, const DMR_AnalyticsCount_t &Delta)
+{
+        size_t i;
+
+        for (i = 0; i < Count; i++) {
+                DMR_AnalyticsKey_t *pKey = AnalyticsFind(Analytics, pKeys[i], Time);
+
+                if (pKey) {
+                        AnalyticsAdd(*pKey, Time, Delta);
+                }
+        }
+}
+
+// Splits [Start, End) at bucket boundaries, so a call that runs over a minute
+// or an hour is counted where it happened.
+static void AnalyticsSpan(DMR_Analytics_t &Analytics, const uint64_t *pKeys, size_t Count, uint64_t Start, uint64_t End, bool bBusy)
+{
+        if (End > Start + ANALYTICS_SPAN_LIMIT) {
+                Start = End - ANALYTICS_SPAN_LIMIT;
+        }
+
+        while (Start < End) {
+                uint64_t Next = (Start / ANALYTICS_BUCKET_TIME + 1) * ANALYTICS_BUCKET_TIME;
+                DMR_AnalyticsCount_t Delta = {};
+
+                if (Next > End) {
+                        Next = End;
+                }
+                if (bBusy) {
+                        Delta.Busy = (uint32_t)(Next - Start);
+                } else {
+                        Delta.Airtime = (uint32_t)(Next - Start);
+                }
+                AnalyticsCount(Analytics, pKeys, Count, Start, Delta);
+                Start = Next;
+        }
+}
+
+static void AnalyticsEndCall(DMR_Analytics_t &Analytics, uint8_t Port, uint64_t Time)
+{
+        DMR_AnalyticsChannel_t &Channel = Analytics.Channel[Port];
+        uint64_t Keys[DMR_ANALYTICS_DIMENSIONS];
+        size_t Count;
+
+        if (Channel.CallStart) {
+                Count = AnalyticsKeys(Channel, Port, true, Keys);
+                AnalyticsSpan(Analytics, Keys, Count, Channel.CallStart, Time, false);
+                Channel.CallStart = 0;
+        }
+}
+
+static void AnalyticsEndBusy(DMR_Analytics_t &Analytics, uint8_t Port, uint64_t Time)
+{
+        DMR_AnalyticsChannel_t &Channel = Analytics.Channel[Port];
+        uint64_t Keys[DMR_ANALYTICS_DIMENSIONS];
+        size_t Count;
+
+        if (Channel.BusySince) {
+                Count = AnalyticsKeys(Channel, Port, false, Keys);
+                AnalyticsSpan(Analytics, Keys, Count, Channel.BusySince, Time, true);
+                Channel.BusySince = 0;
+        }
+}
+
+static void AnalyticsUpdate(DMR_Analytics_t &Analytics, const DMR_Event_t &Event)
+{
+        DMR_AnalyticsChannel_t &Channel = Analytics.Channel[Event.Port];
+        uint64_t Keys[DMR_ANALYTICS_DIMENSIONS];
+        DMR_AnalyticsCount_t Delta = {};
+        size_t Count;
+
+        if (!Analytics.FirstTime) {
+                Analytics.FirstTime = Event.Time;
+        }
+        if (Event.Time > Analytics.LastTime) {
+                Analytics.LastTime = Event.Time;
+        }
+
+        switch (Event.Type) {
+        case DMR_EVENT_CALL_START:
+                AnalyticsEndCall(Analytics, Event.Port, Event.Time);
+                Channel.CallStart = Event.Time;
+                Channel.CallType = Event.CallType;
+                Channel.Source = Event.Source;
+                Channel.Destination = Event.Destination;
+                Delta.Calls = 1;
+                Count = AnalyticsKeys(Channel, Event.Port, true, Keys);
+                AnalyticsCount(Analytics, Keys, Count, Event.Time, Delta);
+                break;
+
+        case DMR_EVENT_CALL_END:
+                AnalyticsEndCall(Analytics, Event.Port, Event.Time);
+                break;
+
+        case DMR_EVENT_DETECTED:
+        {
+                DMR_AnalyticsChannel_t Detected;
+
+                Channel.ColorCode = Event.ColorCode;
+                Channel.bColorCode = true;
+                Detected = Channel;
+                Detected.CallType = Event.CallType;
+                Detected.Source = Event.Source;
+                Detected.Destination = Event.Destination;
+                Delta.Detected = 1;
+                Count = AnalyticsKeys(Detected, Event.Port, true, Keys);
+                AnalyticsCount(Analytics, Keys, Count, Event.Time, Delta);
+                break;
+        }
+
+        case DMR_EVENT_CHANNEL:
+        {
+                // Whatever is in progress so far belongs to the previous channel
+                const uint64_t CallStart = Channel.CallStart;
+                const uint64_t BusySince = Channel.BusySince;
+
+                AnalyticsEndCall(Analytics, Event.Port, Event.Time);
+                AnalyticsEndBusy(Analytics, Event.Port, Event.Time);
+                Channel.ColorCode = Event.ColorCode;
+                Channel.bColorCode = true;
+                Channel.Slot = Event.Slot;
+                Channel.bSlot = true;
+                Channel.CallStart = CallStart ? Event.Time : 0;
+                Channel.BusySince = BusySince ? Event.Time : 0;
+                break;
+        }
+
+        case DMR_EVENT_BUSY:
+                if (Event.Busy && !Channel.BusySince) {
+                        Channel.BusySince = Event.Time;
+                        Count = AnalyticsKeys(Channel, Event.Port, false, Keys);
+                        AnalyticsCount(Analytics, Keys, Count, Event.Time, Delta);
+                } else if (!Event.Busy) {
+                        AnalyticsEndBusy(Analytics, Event.Port, Event.Time);
+                }
+                break;
+        }
+}
+
+// Ends the calls and busy periods in progress, when capture stops
+static void AnalyticsClose(DMR_Analytics_t &Analytics, uint64_t Time)
+{
+        size_t Port;
+
+        if (!Analytics.FirstTime) {
+                return;
+        }
+
+        for (Port = 0; Port < _countof(Analytics.Channel); Port++) {
+                AnalyticsEndCall(Analytics, (uint8_t)Port, Time);
+                AnalyticsEndBusy(Analytics, (uint8_t)Port, Time);
+        }
+        if (Time > Analytics.LastTime) {
+                Analytics.LastTime = Time;
+        }
+}
+
+static uint64_t AnalyticsWindowStart(uint64_t Now)
+{
+        const uint64_t Index = Now / ANALYTICS_BUCKET_TIME;
+
+        return (Index + 1 >= ANALYTICS_BUCKETS) ? (Index + 1 - ANALYTICS_BUCKETS) * ANALYTICS_BUCKET_TIME : 0;
+}
+
+static uint32_t AnalyticsOverlap(uint64_t Start, uint64_t End, uint64_t From, uint64_t To)
+{
+        if (Start < From) {
+                Start = From;
+        }
+        if (End > To) {
+                End = To;
+        }
+
+        return (End > Start) ? (uint32_t)(End - Start) : 0;
+}
+
+// Sums the windows of every key in Dimension as of Now, including the part of
+// the calls and busy periods still in progress.
+static void AnalyticsQuery(const DMR_Analytics_t &Analytics, uint64_t Now, int Dimension, std::vector<DMR_AnalyticsResult_t> &Results)
+{
+        const uint32_t NowIndex = (uint32_t)(Now / ANALYTICS_BUCKET_TIME);
+        const uint32_t NowPeriod = (uint32_t)(Now / ANALYTICS_PERIOD);
+        const uint64_t WindowStart = AnalyticsWindowStart(Now);
+        const uint64_t PeriodStart = (uint64_t)NowPeriod * ANALYTICS_PERIOD;
+        std::unordered_map<uint64_t, size_t> Position;
+        size_t Port;
+        size_t i;
+
+        for (auto &Entry : Analytics.Keys) {
+                const DMR_AnalyticsKey_t &Key = Entry.second;
+                DMR_AnalyticsResult_t Result = {};
+
+                if ((int)(Entry.first >> 32) != Dimension) {
+                        continue;
+                }
+
+                Result.Key = Entry.first;
+                for (i = 0; i < ANALYTICS_BUCKETS; i++) {
+                        if (Key.Bucket[i].Index <= NowIndex && Key.Bucket[i].Index + ANALYTICS_BUCKETS > NowIndex) {
+                                AnalyticsAccumulate(Result.Window, Key.Bucket[i].Count);
+                        }
+                }
+                if (Key.Period == NowPeriod) {
+                        Result.Current = Key.Current;
+                        Result.Previous = Key.Previous;
+                } else if (Key.Period + 1 == NowPeriod) {
+                        Result.Previous = Key.Current;
+                }
+                Position[Entry.first] = Results.size();
+                Results.push_back(Result);
+        }
+
+        for (Port = 0; Port < _countof(Analytics.Channel); Port++) {
+                const DMR_AnalyticsChannel_t &Channel = Analytics.Channel[Port];
+                uint64_t Keys[DMR_ANALYTICS_DIMENSIONS];
+                size_t Count;
+
+                for (int bBusy = 0; bBusy < 2; bBusy++) {
+                        uint64_t Start = bBusy ? Channel.BusySince : Channel.CallStart;
+
+                        if (!Start || Start >= Now) {
+                                continue;
+                        }
+                        if (Now > Start + ANALYTICS_SPAN_LIMIT) {
+                                Start = Now - ANALYTICS_SPAN_LIMIT;
+                        }
+
+                        Count = AnalyticsKeys(Channel, (uint8_t)Port, !bBusy, Keys);
+                        for (i = 0; i < Count; i++) {
+                                auto it = Position.find(Keys[i]);
+
+                                if (it == Position.end()) {
+                                        continue;
+                                }
+
+                                DMR_AnalyticsResult_t &Result = Results[it->second];
+                                DMR_AnalyticsCount_t Window = {}, Current = {}, Previous = {};
+
+                                if (bBusy) {
+                                        Window.Busy = AnalyticsOverlap(Start, Now, WindowStart, Now);
+                                        Current.Busy = AnalyticsOverlap(Start, Now, PeriodStart, Now);
+                                        Previous.Busy = AnalyticsOverlap(Start, Now, PeriodStart - ANALYTICS_PERIOD, PeriodStart);
+                                } else {
+                                        Window.Airtime = AnalyticsOverlap(Start, Now, WindowStart, Now);
+                                        Current.Airtime = AnalyticsOverlap(Start, Now, PeriodStart, Now);
+                                        Previous.Airtime = AnalyticsOverlap(Start, Now, PeriodStart - ANALYTICS_PERIOD, PeriodStart);
+                                }
+                                AnalyticsAccumulate(Result.Window, Window);
+                                AnalyticsAccumulate(Result.Current, Current);
+                                AnalyticsAccumulate(Result.Previous, Previous);
+                        }
+                }
+        }
+}
+
+static void AnalyticsFormat(const DMR_AnalyticsCount_t &Count, uint64_t Length, bool bBusy, char *pOut, size_t OutLength)
+{
+        sprintf_s(pOut, OutLength, "%.1f s, %u calls, %u detected", Count.Airtime / 1000.0, Count.Calls, Count.Detected);
+        if (bBusy) {
+                char Busy[32];
+
+                sprintf_s(Busy, sizeof(Busy), ", %.1f%% busy", Length ? Count.Busy * 100.0 / Length : 0.0);
+                strcat_s(pOut, OutLength, Busy);
+        }
+}
+
+// Copies out the results of Dimension, or of all of them when it is negative
+static void AnalyticsCollect(const DMR_Analytics_t &Analytics, uint64_t Now, int Dimension, DMR_AnalyticsReport_t &Report)
+{
+        LARGE_INTEGER Begin, End;
+        int i;
+
+        QueryPerformanceCounter(&Begin);
+
+        Report.Now = Now;
+        Report.FirstTime = Analytics.FirstTime;
+        Report.Dropped = Analytics.Dropped;
+        Report.Keys = Analytics.Keys.size();
+        Report.Dimension = Dimension;
+        for (i = 0; i < DMR_ANALYTICS_DIMENSIONS; i++) {
+                if (Dimension < 0 || i == Dimension) {
+                        AnalyticsQuery(Analytics, Now, i, Report.Results[i]);
+                }
+        }
+
+        QueryPerformanceCounter(&End);
+        Report.Ticks = End.QuadPart - Begin.QuadPart;
+}
+
+// Logs the channel figures and the top talkgroups and talkers, or every key
+// of the one dimension collected, Limit lines at most.
+static void AnalyticsReport(DMR_AnalyticsReport_t &Report, size_t Limit)
+{
+        const uint64_t Now = Report.Now;
+        const uint64_t WindowStart = AnalyticsWindowStart(Now);
+        const uint64_t PeriodStart = (Now / ANALYTICS_PERIOD) * ANALYTICS_PERIOD;
+        uint64_t WindowLength, PeriodLength, PreviousLength;
+        LARGE_INTEGER Frequency, Begin, End;
+        char TimeStamp[64];
+        char Tmp[512];
+        time_t Time = (time_t)(Now / 1000);
+        tm ti;
+        int i;
+
+        if (!Report.FirstTime) {
+                AddLogMessage("Analytics: no events yet.");
+                return;
+        }
+
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Begin);
+
+        // Busy ratios are over the part of each window that was observed
+        WindowLength = Now - ((Report.FirstTime > WindowStart) ? Report.FirstTime : WindowStart);
+        PeriodLength = Now - ((Report.FirstTime > PeriodStart) ? Report.FirstTime : PeriodStart);
+        PreviousLength = AnalyticsOverlap(Report.FirstTime, Now, PeriodStart - ANALYTICS_PERIOD, PeriodStart);
+
+        localtime_s(&ti, &Time);
+        strftime(TimeStamp, sizeof(TimeStamp), "%Y-%m-%d %H:%M:%S", &ti);
+        sprintf_s(Tmp, sizeof(Tmp), "Analytics at %s: %zu keys, %llu dropped. Last %d min | this hour | last hour:",
+                TimeStamp, Report.Keys, Report.Dropped, ANALYTICS_BUCKETS * ANALYTICS_BUCKET_TIME / 60000);
+        AddLogMessage(Tmp);
+
+        for (i = 0; i < DMR_ANALYTICS_DIMENSIONS; i++) {
+                const bool bChannel = i >= DMR_ANALYTICS_COLOR_CODE;
+                std::vector<DMR_AnalyticsResult_t> &Results = Report.Results[i];
+                size_t n;
+
+                if (Report.Dimension >= 0 && i != Report.Dimension) {
+                        continue;
+                }
+
+                if (bChannel) {
+                        std::sort(Results.begin(), Results.end(), [](const DMR_AnalyticsResult_t &a, const DMR_AnalyticsResult_t &b) {
+                                return a.Key < b.Key;
+                        });
+                } else {
+                        std::sort(Results.begin(), Results.end(), [](const DMR_AnalyticsResult_t &a, const DMR_AnalyticsResult_t &b) {
+                                return (a.Window.Airtime != b.Window.Airtime) ? a.Window.Airtime > b.Window.Airtime : a.Window.Calls > b.Window.Calls;
+                        });
+                }
+
+                for (n = 0; n < Results.size() && (bChannel || n < Limit); n++) {
+                        const DMR_AnalyticsResult_t &Result = Results[n];
+                        char Window[96], Current[96], Previous[96];
+
+                        AnalyticsFormat(Result.Window, WindowLength, bChannel, Window, sizeof(Window));
+                        AnalyticsFormat(Result.Current, PeriodLength, bChannel, Current, sizeof(Current));
+                        AnalyticsFormat(Result.Previous, PreviousLength, bChannel, Previous, sizeof(Previous));
+                        sprintf_s(Tmp, sizeof(Tmp), "  %s %u: %s | %s | %s", analyticsNames[i], (uint32_t)Result.Key, Window, Current, Previous);
+                        AddLogMessage(Tmp);
+                }
+        }
+
+        QueryPerformanceCounter(&End);
+        sprintf_s(Tmp, sizeof(Tmp), "Analytics report took %.3f ms, %.3f ms of it collecting under the lock.",
+                (double)(End.QuadPart - Begin.QuadPart + Report.Ticks) * 1000.0 / Frequency.QuadPart, (double)Report.Ticks * 1000.0 / Frequency.QuadPart);
+        AddLogMessage(Tmp);
+}
+
+// The state thread saves the learned state every STATE_INTERVAL, copying the
+// changed stations STATE_COPY_SLICE at a time under the lock
+static uint64_t StateChecksum(const void *pData, size_t Length, uint64_t Sum)
+{
+        const uint32_t *pWord = (const uint32_t *)pData;
+        uint64_t A = (uint32_t)Sum;
+        uint64_t B = Sum >> 32;
+        size_t i;
+
+        for (i = 0; i < Length / 4; i++) {
+                A += pWord[i];
+                B += A;
+        }
+
+        return ((B & 0xFFFFFFFF) << 32) | (A & 0xFFFFFFFF);
+}
+
+static void StateReindex(DMR_State_t &State, size_t Size)
+{
+        size_t i;
+
+        State.Index.assign(Size, 0);
+        for (i = 0; i < State.Stations.size(); i++) {
+                const uint32_t Hash = State.Stations[i].Id * 0x9E3779B1U;
+                size_t Slot;
+
+                for (Slot = (Hash ^ (Hash >> 16)) & (Size - 1); State.Index[Slot]; Slot = (Slot + 1) & (Size - 1)) {
+                }
+                State.Index[Slot] = (uint32_t)i + 1;
+        }
+}
+
+static DMR_Station_t *StationFind(DMR_State_t &State, uint32_t Id, bool bCreate)
+{
+        const uint32_t Hash = Id * 0x9E3779B1U;
+        size_t Mask, Slot;
+
+        if (State.Index.empty()) {
+                if (!bCreate) {
+                        return NULL;
+                }
+                StateReindex(State, STATE_MIN_INDEX);
+        }
+
+        Mask = State.Index.size() - 1;
+        for (Slot = (Hash ^ (Hash >> 16)) & Mask; State.Index[Slot]; Slot = (Slot + 1) & Mask) {
+                if (State.Stations[State.Index[Slot] - 1].Id == Id) {
+                        return &State.Stations[State.Index[Slot] - 1];
+                }
+        }
+        if (!bCreate) {
+                return NULL;
+        }
+
+        // Keep the index at most half full
+        if ((State.Stations.size() + 1) * 2 > State.Index.size()) {
+                StateReindex(State, State.Index.size() * 2);
+                return StationFind(State, Id, true);
+        }
+
+        State.Index[Slot] = (uint32_t)State.Stations.size() + 1;
+        State.Stations.push_back(DMR_Station_t());
+        State.Stations.back().Id = Id;
+
+        return &State.Stations.back();
+}
+
+static void StationChanged(DMR_State_t &State, const DMR_Station_t *pStation)
+{
+        State.Dirty.push_back((uint32_t)(pStation - State.Stations.data()));
+        if (State.Dirty.size() > State.Stations.size()) {
+                State.Dirty.clear();
+                State.bFullCopy = true;
+        }
+        State.bChanged = true;
+}
+
+// Keeps the latest event of its type per port
+static void StateRemember(DMR_State_t &State, const DMR_Event_t &Event)
+{
+        for (auto &Entry : State.Events) {
+                if (Entry.Type == Event.Type && Entry.Port == Event.Port) {
+                        Entry = Event;
+                        return;
+                }
+        }
+        State.Events.push_back(Event);
+}
+
+static void StateUpdate(DMR_State_t &State, const DMR_Event_t &Event)
+{
+        DMR_Station_t *pStation;
+        size_t i;
+
+        switch (Event.Type) {
+        case DMR_EVENT_ALIAS:
+                if (Event.Source) {
+                        std::lock_guard<std::mutex> lock(State.Mutex);
+
+                        pStation = StationFind(State, Event.Source, true);
+                        pStation->AliasFormat = Event.AliasFormat;
+                        pStation->AliasLength = (Event.Count < sizeof(pStation->Alias)) ? Event.Count : sizeof(pStation->Alias) - 1;
+                        memcpy(pStation->Alias, Event.Alias, pStation->AliasLength);
+                        pStation->Alias[pStation->AliasLength] = 0;
+                        pStation->AliasTime = Event.Time;
+                        StationChanged(State, pStation);
+                }
+                break;
+
+        case DMR_EVENT_GPS:
+                if (Event.Source) {
+                        std::lock_guard<std::mutex> lock(State.Mutex);
+
+                        pStation = StationFind(State, Event.Source, true);
+                        pStation->bGps = 1;
+                        pStation->Latitude = Event.Latitude;
+                        pStation->Longitude = Event.Longitude;
+                        pStation->GpsTime = Event.Time;
+                        StationChanged(State, pStation);
+                }
+                break;
+
+        case DMR_EVENT_CHANNEL:
+        case DMR_EVENT_GROUP_LIST:
+        case DMR_EVENT_CALL_START:
+        {
+                std::lock_guard<std::mutex> lock(State.Mutex);
+
+                StateRemember(State, Event);
+                State.bChanged = true;
+                break;
+        }
+
+        case DMR_EVENT_CALL_END:
+        {
+                std::lock_guard<std::mutex> lock(State.Mutex);
+
+                for (i = 0; i < State.Events.size(); i++) {
+                        if (State.Events[i].Type == DMR_EVENT_CALL_START && State.Events[i].Port == Event.Port) {
+                                State.Events.erase(State.Events.begin() + i);
+                                State.bChanged = true;
+                                break;
+                        }
+                }
+                break;
+        }
+        }
+}
+
+static bool StateWrite(HANDLE hFile, const void *pData, size_t Length)
+{
+        const uint8_t *pBytes = (const uint8_t *)pData;
+        DWORD Written;
+
+        while (Length) {
+                const DWORD Chunk = (Length > (1 << 24)) ? (1 << 24) : (DWORD)Length;
+
+                if (!WriteFile(hFile, pBytes, Chunk, &Written, NULL) || Written != Chunk) {
+                        return false;
+                }
+                pBytes += Chunk;
+                Length -= Chunk;
+        }
+
+        return true;
+}
+
+// Puts back what a failed snapshot took, so that the next one retries it
+static void StateUnsaved(DMR_State_t &State, bool bFull, const std::vector<uint32_t> &Dirty)
+{
+        std::lock_guard<std::mutex> lock(State.Mutex);
+
+        if (bFull || State.Dirty.size() + Dirty.size() > State.Stations.size()) {
+                State.Dirty.clear();
+                State.bFullCopy = true;
+        } else if (!State.bFullCopy) {
+                State.Dirty.insert(State.Dirty.end(), Dirty.begin(), Dirty.end());
+        }
+        State.bChanged = true;
+}
+
+static void StateSnapshot(DMR_State_t &State, bool bForce)
+{
+        std::vector<DMR_Event_t> Events;
+        std::vector<uint32_t> Dirty;
+        LARGE_INTEGER Frequency, Begin, Locked, End;
+        DMR_StateHeader_t Header;
+        LONGLONG Held = 0;
+        size_t Count, Start, i;
+        char Tmp[MAX_PATH + 256];
+        HANDLE hFile;
+        bool bFull;
+        bool Success;
+
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Begin);
+        {
+                std::lock_guard<std::mutex> lock(State.Mutex);
+
+                if (!State.bChanged && !bForce) {
+                        return;
+                }
+                bFull = State.bFullCopy;
+                Dirty.swap(State.Dirty);
+                Events = State.Events;
+                Count = State.Stations.size();
+                State.bFullCopy = false;
+                State.bChanged = false;
+        }
+
+        // Changes made while copying are marked dirty again and saved next time
+        State.Shadow.resize(Count);
+        for (Start = 0; Start < (bFull ? Count : Dirty.size()); Start += STATE_COPY_SLICE) {
+                QueryPerformanceCounter(&Locked);
+                {
+                        std::lock_guard<std::mutex> lock(State.Mutex);
+
+                        if (bFull) {
+                                memcpy(&State.Shadow[Start], &State.Stations[Start], ((Count - Start < STATE_COPY_SLICE) ? Count - Start : STATE_COPY_SLICE) * sizeof(DMR_Station_t));
+                        } else {
+                                for (i = Start; i < Dirty.size() && i < Start + STATE_COPY_SLICE; i++) {
+                                        State.Shadow[Dirty[i]] = State.Stations[Dirty[i]];
+                                }
+                        }
+                }
+                QueryPerformanceCounter(&End);
+                if (End.QuadPart - Locked.QuadPart > Held) {
+                        Held = End.QuadPart - Locked.QuadPart;
+                }
+        }
+
+        memset(&Header, 0, sizeof(Header));
+        Header.Magic = STATE_MAGIC;
+        Header.Version = STATE_VERSION;
+        Header.HeaderSize = sizeof(Header);
+        Header.Time = GetTimeStamp();
+        Header.StationCount = (uint32_t)Count;
+        Header.EventCount = (uint32_t)Events.size();
+        Header.Checksum = StateChecksum(State.Shadow.data(), Count * sizeof(DMR_Station_t), 0);
+        Header.Checksum = StateChecksum(Events.data(), Events.size() * sizeof(DMR_Event_t), Header.Checksum);
+
+        // Written next to the old state and renamed over it, so a crash never leaves half a file
+        hFile = CreateFile(State.pTempFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create %s.", State.pTempFile);
+                AddLogMessage(Tmp);
+                StateUnsaved(State, bFull, Dirty);
+                return;
+        }
+        Success = StateWrite(hFile, &Header, sizeof(Header)) &&
+                StateWrite(hFile, State.Shadow.data(), Count * sizeof(DMR_Station_t)) &&
+                StateWrite(hFile, Events.data(), Events.size() * sizeof(DMR_Event_t));
+        CloseHandle(hFile);
+        if (!Success || !MoveFileEx(State.pTempFile, State.pFile, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to write %s.", State.pFile);
+                AddLogMessage(Tmp);
+                DeleteFile(State.pTempFile);
+                StateUnsaved(State, bFull, Dirty);
+                return;
+        }
+        QueryPerformanceCounter(&End);
+
+        sprintf_s(Tmp, sizeof(Tmp), "State: saved %zu stations (%zu changed) and %zu channel records in %.3f ms, capture held for at most %.3f ms.",
+                Count, bFull ? Count : Dirty.size(), Events.size(),
+                (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart,
+                (double)Held * 1000.0 / Frequency.QuadPart);
+        AddLogMessage(Tmp);
+}
+
+static void StateThread(void)
+{
+        bool bStop, bSave;
+
+        do {
+                {
+                        std::unique_lock<std::mutex> lock(state.Mutex);
+
+                        stateWake.wait_for(lock, std::chrono::milliseconds(STATE_INTERVAL), [] {
+                                return stateStop || stateSave;
+                        });
+                        bStop = stateStop;
+                        bSave = stateSave;
+                        stateSave = false;
+                }
+                StateSnapshot(state, bSave);
+        } while (!bStop);
+}
+
+// Maps the state file and copies it in after checking its size and checksum
+static void StateRestore(DMR_State_t &State)
+{
+        const DMR_StateHeader_t *pHeader;
+        LARGE_INTEGER Frequency, Begin, End;
+        LARGE_INTEGER Size;
+        HANDLE hFile, hMapping;
+        const uint8_t *pView;
+        char TimeStamp[64];
+        char Tmp[MAX_PATH + 256];
+        time_t Time;
+        tm ti;
+
+        hFile = CreateFile(State.pFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+                return;
+        }
+
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Begin);
+
+        GetFileSizeEx(hFile, &Size);
+        if ((uint64_t)Size.QuadPart < sizeof(DMR_StateHeader_t)) {
+                CloseHandle(hFile);
+                sprintf_s(Tmp, sizeof(Tmp), "Error: %s is truncated, starting without saved state.", State.pFile);
+                AddLogMessage(Tmp);
+                return;
+        }
+
+        hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        pView = hMapping ? (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!pView) {
+                if (hMapping) {
+                        CloseHandle(hMapping);
+                }
+                CloseHandle(hFile);
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to map %s.", State.pFile);
+                AddLogMessage(Tmp);
+                return;
+        }
+
+        pHeader = (const DMR_StateHeader_t *)pView;
+        if (pHeader->Magic != STATE_MAGIC || pHeader->Version != STATE_VERSION || pHeader->HeaderSize != sizeof(DMR_StateHeader_t) ||
+                (uint64_t)Size.QuadPart != sizeof(DMR_StateHeader_t) + (uint64_t)pHeader->StationCount * sizeof(DMR_Station_t) + (uint64_t)pHeader->EventCount * sizeof(DMR_Event_t) ||
+                StateChecksum(pView + sizeof(DMR_StateHeader_t), (size_t)Size.QuadPart - sizeof(DMR_StateHeader_t), 0) != pHeader->Checksum) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: %s is not a valid state file, starting without saved state.", State.pFile);
+                AddLogMessage(Tmp);
+        } else {
+                const DMR_Station_t *pStations = (const DMR_Station_t *)(pView + sizeof(DMR_StateHeader_t));
+                const DMR_Event_t *pEvents = (const DMR_Event_t *)(pStations + pHeader->StationCount);
+                size_t IndexSize = STATE_MIN_INDEX;
+
+                {
+                        std::lock_guard<std::mutex> lock(State.Mutex);
+
+                        while (IndexSize < (size_t)pHeader->StationCount * 2) {
+                                IndexSize *= 2;
+                        }
+                        State.Stations.assign(pStations, pStations + pHeader->StationCount);
+                        StateReindex(State, IndexSize);
+                        State.Events.assign(pEvents, pEvents + pHeader->EventCount);
+                        State.Dirty.clear();
+                        State.bFullCopy = false;
+                }
+                // Nothing is saving this state yet, so its copy can be filled here
+                State.Shadow.assign(pStations, pStations + pHeader->StationCount);
+                QueryPerformanceCounter(&End);
+
+                Time = (time_t)(pHeader->Time / 1000);
+                localtime_s(&ti, &Time);
+                strftime(TimeStamp, sizeof(TimeStamp), "%Y-%m-%d %H:%M:%S", &ti);
+                sprintf_s(Tmp, sizeof(Tmp), "State: restored %u stations and %u channel records saved at %s in %.3f ms.",
+                        pHeader->StationCount, pHeader->EventCount, TimeStamp,
+                        (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart);
+                AddLogMessage(Tmp);
+        }
+
+        UnmapViewOfFile(pView);
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+}
+
+static void StateStart(void)
+{
+        StateRestore(state);
+        stateStop = false;
+        stateThread = std::make_unique<std::thread>(StateThread);
+}
+
+// Saves the state one last time
+static void StateStop(void)
+{
+        if (!stateThread) {
+                return;
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(state.Mutex);
+                stateStop = true;
+        }
+        stateWake.notify_one();
+        stateThread->join();
+        stateThread.reset();
+}
+
+// Picks up a call that was in progress when the monitor was restarted
+static void StateResumeCall(DMR_Decoder_t &Decoder)
+{
+        const uint64_t Now = GetTimeStamp();
+
+        std::lock_guard<std::mutex> lock(state.Mutex);
+
+        for (auto &Entry : state.Events) {
+                if (Entry.Type == DMR_EVENT_CALL_START && Entry.Port == Decoder.Port && Entry.Time + STATE_CALL_AGE > Now) {
+                        Decoder.CurrentCall = Entry;
+                }
+        }
+}
+
+// Times updates, full and partial snapshots and a restore on Count synthetic stations in a scratch file
+static void StateBench(size_t Count)
+{
+        DMR_State_t Bench = { STATE_BENCH_FILE, STATE_BENCH_TEMP_FILE };
+        DMR_State_t Restored = { STATE_BENCH_FILE, STATE_BENCH_TEMP_FILE };
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        char Tmp[256];
+        size_t i;
+
+        QueryPerformanceFrequency(&Frequency);
+
+        Event.Time = GetTimeStamp();
+        Event.Count = 10;
+        memcpy(Event.Alias, "BENCH ALIAS", 11);
+        Event.Latitude = 0x2A0000;
+        Event.Longitude = 0x0C0000;
+
+        QueryPerformanceCounter(&Begin);
+        for (i = 0; i < Count; i++) {
+                Event.Type = (i & 1) ? DMR_EVENT_GPS : DMR_EVENT_ALIAS;
+                Event.Source = (uint32_t)(1000000 + i * 7);
+                StateUpdate(Bench, Event);
+        }
+        QueryPerformanceCounter(&End);
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu station updates, %.1f ns per update.", Count,
+                Count ? (double)(End.QuadPart - Begin.QuadPart) * 1e9 / Frequency.QuadPart / Count : 0.0);
+        AddLogMessage(Tmp);
+
+        StateSnapshot(Bench, true);
+        for (i = 0; i < Count; i += 100) {
+                Event.Type = DMR_EVENT_ALIAS;
+                Event.Source = (uint32_t)(1000000 + i * 7);
+                StateUpdate(Bench, Event);
+        }
+        StateSnapshot(Bench, true);
+        StateRestore(Restored);
+
+        DeleteFile(STATE_BENCH_FILE);
+}
+
+// Search index of the events still in the log pane, posting lists per term
+static uint64_t SearchHash(const char *pField, const char *pValue)
+{
+        uint64_t Hash = 0xCBF29CE484222325ULL;
+        const char *p;
+
+        for (p = pField; *p; p++) {
+                Hash = (Hash ^ (uint8_t)*p) * 0x100000001B3ULL;
+        }
+        Hash = (Hash ^ ':') * 0x100000001B3ULL;
+        for (p = pValue; *p; p++) {
+                Hash = (Hash ^ (uint8_t)tolower((uint8_t)*p)) * 0x100000001B3ULL;
+        }
+
+        return Hash;
+}
+
+static uint64_t SearchHashId(const char *pField, uint32_t Id)
+{
+        uint64_t Hash = SearchHash(pField, "");
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                Hash = (Hash ^ (uint8_t)(Id >> (i * 8))) * 0x100000001B3ULL;
+        }
+
+        return Hash;
+}
+
+// Four character Maidenhead locator of a GPS fix, e.g. JO62
+static void SearchLocator(const DMR_Event_t &Event, char *pOut)
+{
+        const double Lon = (double)Event.Longitude * 360 / 33554432 + 180;
+        const double Lat = (double)Event.Latitude * 180 / 16777216 + 90;
+        const int LonSquare = (int)(Lon / 2) % 180;
+        const int LatSquare = (int)Lat % 180;
+
+        pOut[0] = (char)('A' + LonSquare / 10 % 18);
+        pOut[1] = (char)('A' + LatSquare / 10 % 18);
+        pOut[2] = (char)('0' + LonSquare % 10);
+        pOut[3] = (char)('0' + LatSquare % 10);
+        pOut[4] = 0;
+}
+
+static void SearchTerms(const DMR_Event_t &Event, std::vector<uint64_t> &Terms)
+{
+        char Word[128];
+        size_t Length = 0;
+        size_t i;
+
+        Terms.push_back(SearchHash("type", GetEventName(Event.Type)));
+        Terms.push_back(SearchHashId("port", Event.Port));
+        if (Event.Source) {
+                Terms.push_back(SearchHashId("id", Event.Source));
+                Terms.push_back(SearchHashId("src", Event.Source));
+        }
+        if (Event.Destination) {
+                Terms.push_back(SearchHashId("id", Event.Destination));
+                Terms.push_back(SearchHashId("dst", Event.Destination));
+        }
+
+        switch (Event.Type) {
+        case DMR_EVENT_DETECTED:
+                Terms.push_back(SearchHashId("cc", Event.ColorCode));
+                break;
+
+        case DMR_EVENT_CHANNEL:
+                Terms.push_back(SearchHashId("cc", Event.ColorCode));
+                Terms.push_back(SearchHashId("ts", Event.Slot));
+                break;
+
+        case DMR_EVENT_GROUP_LIST:
+                for (i = 0; i < Event.Count; i++) {
+                        Terms.push_back(SearchHashId("id", Event.Groups[i]));
+                }
+                break;
+
+        case DMR_EVENT_GPS:
+                SearchLocator(Event, Word);
+                Terms.push_back(SearchHash("loc", Word));
+                break;
+
+        case DMR_EVENT_ALIAS:
+                // Words are runs of letters, digits and UTF-8 sequences
+                for (i = 0; i <= Event.Count; i++) {
+                        const uint8_t c = (uint8_t)Event.Alias[i];
+
+                        if (i < Event.Count && (isalnum(c) || c >= 0x80)) {
+                                Word[Length++] = (char)c;
+                                continue;
+                        }
+                        if (Length) {
+                                Word[Length] = 0;
+                                Terms.push_back(SearchHash("word", Word));
+                                Length = 0;
+                        }
+                }
+                break;
+        }
+
+        std::sort(Terms.begin(), Terms.end());
+        Terms.erase(std::unique(Terms.begin(), Terms.end()), Terms.end());
+}
+
+static void SearchTrim(DMR_Posting_t &Posting, uint64_t First)
+{
+        while (Posting.Start < Posting.Docs.size() && Posting.Docs[Posting.Start] < First) {
+                Posting.Start++;
+        }
+        if (Posting.Start >= 64 && Posting.Start * 2 >= Posting.Docs.size()) {
+                Posting.Docs.erase(Posting.Docs.begin(), Posting.Docs.begin() + Posting.Start);
+                Posting.Start = 0;
+        }
+}
+
+static uint64_t SearchFirst(const DMR_Search_t &Search)
+{
+        const uint64_t First = (Search.Next > SCROLLBACK_LINES) ? Search.Next - SCROLLBACK_LINES : 0;
+
+        return (Search.First > First) ? Search.First : First;
+}
+
+static void SearchAdd(DMR_Search_t &Search, const DMR_Event_t &Event)
+{
+        std::vector<uint64_t> Terms;
+        std::vector<uint64_t> Unused;
+        uint64_t Doc, First;
+        size_t Buckets, i;
+        char Text[512];
+
+        FormatEvent(Event, Text, sizeof(Text));
+        SearchTerms(Event, Terms);
+
+        std::lock_guard<std::mutex> lock(Search.Mutex);
+
+        Doc = Search.Next++;
+        First = SearchFirst(Search);
+        if (Search.Docs.size() < SCROLLBACK_LINES) {
+                Search.Docs.push_back({ Event.Time, Text });
+        } else {
+                Search.Docs[Doc % SCROLLBACK_LINES].Time = Event.Time;
+                Search.Docs[Doc % SCROLLBACK_LINES].Text = Text;
+        }
+
+        for (auto Term : Terms) {
+                DMR_Posting_t &Posting = Search.Postings[Term];
+
+                SearchTrim(Posting, First);
+                Posting.Docs.push_back(Doc);
+        }
+
+        // Terms that are no longer seen would otherwise keep their postings
+        Buckets = Search.Postings.bucket_count();
+        for (i = 0; i < SEARCH_SWEEP_BUCKETS; i++) {
+                const size_t Bucket = Search.Sweep++ % Buckets;
+
+                for (auto it = Search.Postings.begin(Bucket); it != Search.Postings.end(Bucket); ++it) {
+                        SearchTrim(it->second, First);
+                        if (it->second.Start == it->second.Docs.size()) {
+                                Unused.push_back(it->first);
+                        }
+                }
+        }
+        for (auto Term : Unused) {
+                Search.Postings.erase(Term);
+        }
+}
+
+// Called by the log pane once the lines of the events before First are gone
+static void SearchEvict(DMR_Search_t &Search, uint64_t First)
+{
+        std::lock_guard<std::mutex> lock(Search.Mutex);
+
+        if (First > Search.First) {
+                Search.First = First;
+        }
+}
+
+static uint64_t SearchCount(DMR_Search_t &Search)
+{
+        std::lock_guard<std::mutex> lock(Search.Mutex);
+
+        return Search.Next;
+}
+
+// Query words to terms: an ID, FIELD=VALUE or a word of a talker alias
+static bool SearchParse(const std::vector<std::string> &Words, std::vector<uint64_t> &Terms)
+{
+        static const char *const Fields[] = { "id", "src", "dst", "cc", "ts", "port", "type", "loc", "word" };
+
+        for (auto &Word : Words) {
+                const size_t Equals = Word.find('=');
+
+                if (Equals == std::string::npos) {
+                        if (Word.find_first_not_of("0123456789") == std::string::npos) {
+                                Terms.push_back(SearchHashId("id", strtoul(Word.c_str(), NULL, 10)));
+                        } else {
+                                Terms.push_back(SearchHash("word", Word.c_str()));
+                        }
+                        continue;
+                }
+
+                const std::string Field = Word.substr(0, Equals);
+                const std::string Value = Word.substr(Equals + 1);
+                bool bKnown = false;
+
+                for (auto pField : Fields) {
+                        bKnown |= Field == pField;
+                }
+                if (!bKnown) {
+                        return false;
+                }
+                if (Field != "type" && Field != "loc" && Field != "word") {
+                        Terms.push_back(SearchHashId(Field.c_str(), strtoul(Value.c_str(), NULL, 10)));
+                } else {
+                        Terms.push_back(SearchHash(Field.c_str(), Value.c_str()));
+                }
+        }
+
+        return true;
+}
+
+// Copies up to Limit events older than Cursor that have every term, newest
+// first. Returns the last one copied to continue from, 0 when there are no more.
+static uint64_t SearchQuery(DMR_Search_t &Search, const std::vector<uint64_t> &Terms, uint64_t Cursor, size_t Limit, std::vector<DMR_SearchDoc_t> &Results)
+{
+        std::vector<const DMR_Posting_t *> Postings;
+        uint64_t First;
+
+        std::lock_guard<std::mutex> lock(Search.Mutex);
+
+        First = SearchFirst(Search);
+        for (auto Term : Terms) {
+                auto it = Search.Postings.find(Term);
+
+                if (it == Search.Postings.end()) {
+                        return 0;
+                }
+                Postings.push_back(&it->second);
+        }
+        if (Postings.empty()) {
+                return 0;
+        }
+
+        // Walk the shortest list and look the others up
+        std::sort(Postings.begin(), Postings.end(), [](const DMR_Posting_t *a, const DMR_Posting_t *b) {
+                return a->Docs.size() - a->Start < b->Docs.size() - b->Start;
+        });
+
+        const DMR_Posting_t &Driver = *Postings[0];
+        auto Begin = Driver.Docs.begin() + Driver.Start;
+        auto it = std::lower_bound(Begin, Driver.Docs.end(), Cursor);
+
+        while (it != Begin) {
+                const uint64_t Doc = *--it;
+                size_t i;
+
+                if (Doc < First) {
+                        break;
+                }
+                for (i = 1; i < Postings.size(); i++) {
+                        if (!std::binary_search(Postings[i]->Docs.begin() + Postings[i]->Start, Postings[i]->Docs.end(), Doc)) {
+                                break;
+                        }
+                }
+                if (i < Postings.size()) {
+                        continue;
+                }
+
+                Results.push_back(Search.Docs[Doc % SCROLLBACK_LINES]);
+                if (Results.size() >= Limit || !Doc) {
+                        return Doc;
+                }
+        }
+
+        return 0;
+}
+
+// Times indexing and queries on Count synthetic events in an index of its own
+static void SearchBench(size_t Count)
+{
+        static const char *const Words[] = { "Anna", "Bert", "Club", "Dave", "Echo", "Fox", "Gate", "Hill" };
+        DMR_Search_t Bench = {};
+        std::vector<DMR_SearchDoc_t> Results;
+        std::vector<uint64_t> Terms;
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        uint64_t Cursor;
+        size_t Matches, Pages, i;
+        char Tmp[256];
+
+        QueryPerformanceFrequency(&Frequency);
+
+        QueryPerformanceCounter(&Begin);
+        for (i = 0; i < Count; i++) {
+                Event.Time = GetTimeStamp();
+                Event.Source = (uint32_t)(2000000 + i % 1000);
+                Event.Destination = (uint32_t)(91 + i % 50);
+                switch (i % 4) {
+                case 0:
+                        Event.Type = DMR_EVENT_CALL_START;
+                        break;
+                case 1:
+                        Event.Type = DMR_EVENT_CALL_END;
+                        break;
+                case 2:
+                        Event.Type = DMR_EVENT_ALIAS;
+                        Event.Count = (uint8_t)sprintf_s(Event.Alias, sizeof(Event.Alias), "%s %s", Words[i / 4 % 8], Words[i / 32 % 8]);
+                        break;
+                default:
+                        Event.Type = DMR_EVENT_GPS;
+                        Event.Latitude = (int32_t)(i % 4096) << 12;
+                        Event.Longitude = (int32_t)(i % 8192) << 12;
+                        break;
+                }
+                SearchAdd(Bench, Event);
+        }
+        QueryPerformanceCounter(&End);
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu events indexed, %.1f ns per event, %zu terms.", Count,
+                Count ? (double)(End.QuadPart - Begin.QuadPart) * 1e9 / Frequency.QuadPart / Count : 0.0, Bench.Postings.size());
+        AddLogMessage(Tmp);
+
+        Terms.push_back(SearchHash("type", GetEventName(DMR_EVENT_CALL_START)));
+        QueryPerformanceCounter(&Begin);
+        SearchQuery(Bench, Terms, UINT64_MAX, SEARCH_RESULT_LINES, Results);
+        QueryPerformanceCounter(&End);
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: first page of type=%s, %zu events in %.3f ms.", GetEventName(DMR_EVENT_CALL_START), Results.size(),
+                (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart);
+        AddLogMessage(Tmp);
+
+        Terms.clear();
+        Terms.push_back(SearchHashId("id", 2000002));
+        Terms.push_back(SearchHash("word", Words[0]));
+        Matches = 0;
+        Pages = 0;
+        QueryPerformanceCounter(&Begin);
+        for (Cursor = UINT64_MAX; Cursor; Pages++) {
+                Results.clear();
+                Cursor = SearchQuery(Bench, Terms, Cursor, SEARCH_RESULT_LINES, Results);
+                Matches += Results.size();
+        }
+        QueryPerformanceCounter(&End);
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: all %zu events with id=2000002 and %s in %zu pages, %.3f ms.", Matches, Words[0], Pages,
+                (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart);
+        AddLogMessage(Tmp);
+}
+
+static void DispatchEvent(const DMR_Event_t &Event, const uint8_t *pFrame, size_t FrameLength)
+{
+        RingWrite(pRing, Event, pFrame, FrameLength);
+        RecorderWatch(recorder, Event);
+        ArchiveAppend(archive, Event);
+
+        if (Event.Type != DMR_EVENT_NONE) {
+                SinkAppend(Event);
+                PublishEvent(Event);
+
+                StateUpdate(state, Event);
+                SearchAdd(search, Event);
+
+                std::lock_guard<std::mutex> lock(analyticsMutex);
+                AnalyticsUpdate(analytics, Event);
+        }
+}
+
+// Decodes the next frame in the decoder's buffer and hands accepted frames to
+// Consumer(Event, pFrame, FrameLength).
+template <typename T>
+static std::pair<bool, std::string> ScanForFrames(DMR_Decoder_t &Decoder, uint64_t Time, T Consumer)
+{
+        std::vector<uint8_t> &buffer = Decoder.Buffer;
+        size_t i;
+
+        while (buffer.size()) {
+                for (i = 0; i < buffer.size(); i++) {
+                        if (buffer[i] == DMR_FRAME_HEAD) {
+                                break;
+                        }
+                }
+
+                if (i) {
+                        buffer.erase(buffer.begin(), buffer.begin() + i);
+                }
+
+                if (!buffer.size() || buffer[0] == DMR_FRAME_HEAD) {
+                        break;
+                }
+        }
+
+        if (!buffer.size()) {
+                return { false, "" };
+        }
+
+        char Msg[512];
+        size_t Length = buffer.size();
+        DMR_Event_t Event;
+        bool Success;
+
+        memset(&Event, 0, sizeof(Event));
+        Event.Time = Time;
+        Event.Port = Decoder.Port;
+
+        Success = ProcessMessage(buffer.data(), Length, Msg, sizeof(Msg), Event, Decoder);
+        if (Success) {
+                Consumer(Event, buffer.data(), Length);
+        } else if (Length == 1 && Decoder.pRecorder) {
+                RecorderFailure(*Decoder.pRecorder);
+        }
+        if (Length) {
+                buffer.erase(buffer.begin(), buffer.begin() + Length);
+        }
+
+        return { Success, Msg };
+}
+
+static bool MergeCompare(const DMR_MergeEntry_t &a, const DMR_MergeEntry_t &b)
+{
+        return (a.Event.Time != b.Event.Time) ? a.Event.Time > b.Event.Time : a.Sequence > b.Sequence;
+}
+
+static bool MergeReadHeader(HANDLE hFile, DMR_RecordingHeader_t &Header)
+{
+        DWORD Read;
+
+        return ReadFile(hFile, &Header, sizeof(Header), &Read, NULL) && Read == sizeof(Header) &&
+                Header.Magic == RECORDING_MAGIC && Header.Version == RECORDING_VERSION;
+}
+
+// Reads the next chunk of a recording and decodes it into the merge heap.
+// Returns false at the end of the recording.
+static bool MergeReadChunk(DMR_Merge_t &Merge, DMR_MergeSource_t &Source)
+{
+        DMR_RecordingChunk_t Chunk;
+        size_t Start = Source.Decoder.Buffer.size();
+        DWORD Read;
+
+        if (!ReadFile(Source.hFile, &Chunk, sizeof(Chunk), &Read, NULL) || Read != sizeof(Chunk) || Chunk.Length > RECORDER_BYTES) {
+                return false;
+        }
+
+        Source.Decoder.Buffer.resize(Start + Chunk.Length);
+        if (!ReadFile(Source.hFile, Source.Decoder.Buffer.data() + Start, Chunk.Length, &Read, NULL) || Read != Chunk.Length) {
+                return false;
+        }
+        Source.LastTime = Chunk.Time;
+
+        while (ScanForFrames(Source.Decoder, Chunk.Time, [&Merge](const DMR_Event_t &Event, const uint8_t *, size_t) {
+                if (Event.Type != DMR_EVENT_NONE) {
+                        Merge.Heap.push_back({ Event, Merge.Sequence++ });
+                        std::push_heap(Merge.Heap.begin(), Merge.Heap.end(), MergeCompare);
+                }
+        }).first) {
+        }
+
+        return true;
+}
+
+static void MergeOpen(DMR_Merge_t &Merge, const DMR_MergeFile_t &File)
+{
+        std::unique_ptr<DMR_MergeSource_t> pSource(new DMR_MergeSource_t());
+        DMR_RecordingHeader_t Header;
+
+        pSource->hFile = CreateFile(File.Path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (pSource->hFile == INVALID_HANDLE_VALUE) {
+                return;
+        }
+        if (!MergeReadHeader(pSource->hFile, Header)) {
+                CloseHandle(pSource->hFile);
+                return;
+        }
+
+        pSource->Decoder.Port = Header.Port;
+        pSource->LastTime = File.StartTime;
+        Merge.Sources.push_back(std::move(pSource));
+        if (Merge.Sources.size() > Merge.MaxOpen) {
+                Merge.MaxOpen = Merge.Sources.size();
+        }
+}
+
+// Emits the buffered events older than the watermark minus MERGE_REORDER_WINDOW
+template <typename T>
+static void MergeDrain(DMR_Merge_t &Merge, uint64_t Watermark, T Output)
+{
+        while (Merge.Heap.size() && (Watermark == UINT64_MAX || Merge.Heap.front().Event.Time + MERGE_REORDER_WINDOW <= Watermark)) {
+                std::pop_heap(Merge.Heap.begin(), Merge.Heap.end(), MergeCompare);
+
+                const DMR_Event_t &Event = Merge.Heap.back().Event;
+
+                if (Event.Time < Merge.LastTime) {
+                        Merge.Late++;
+                } else {
+                        Merge.LastTime = Event.Time;
+                }
+                Merge.Events++;
+                Output(Event);
+                Merge.Heap.pop_back();
+        }
+}
+
+// K-way merge of recordings by time, opening each only when the merge reaches its first event
+template <typename T>
+static void MergeRecordings(DMR_Merge_t &Merge, std::vector<DMR_MergeFile_t> &Files, volatile bool &bAbort, T Output)
+{
+        size_t Next = 0;
+
+        std::sort(Files.begin(), Files.end(), [](const DMR_MergeFile_t &a, const DMR_MergeFile_t &b) {
+                return a.StartTime < b.StartTime;
+        });
+
+        while (!bAbort && (Next < Files.size() || Merge.Sources.size())) {
+                uint64_t Watermark = UINT64_MAX;
+                size_t Laggard = 0;
+                size_t i;
+
+                if (Merge.Sources.empty()) {
+                        MergeOpen(Merge, Files[Next++]);
+                        continue;
+                }
+
+                for (i = 0; i < Merge.Sources.size(); i++) {
+                        if (Merge.Sources[i]->LastTime < Watermark) {
+                                Watermark = Merge.Sources[i]->LastTime;
+                                Laggard = i;
+                        }
+                }
+                if (Next < Files.size() && Files[Next].StartTime <= Watermark) {
+                        MergeOpen(Merge, Files[Next++]);
+                        continue;
+                }
+
+                if (!MergeReadChunk(Merge, *Merge.Sources[Laggard])) {
+                        CloseHandle(Merge.Sources[Laggard]->hFile);
+                        Merge.Sources.erase(Merge.Sources.begin() + Laggard);
+                        continue;
+                }
+
+                if (Next < Files.size() && Files[Next].StartTime < Watermark) {
+                        Watermark = Files[Next].StartTime;
+                }
+                MergeDrain(Merge, Watermark, Output);
+        }
+
+        for (auto &pSource : Merge.Sources) {
+                CloseHandle(pSource->hFile);
+        }
+        Merge.Sources.clear();
+
+        MergeDrain(Merge, UINT64_MAX, Output);
+}
+
+static void MergeThread(std::string OutputPath, std::vector<DMR_MergeFile_t> Files)
+{
+        DMR_Merge_t Merge = {};
+        DMR_Analytics_t Analytics = {};
+        DMR_AnalyticsReport_t Report = {};
+        LARGE_INTEGER Frequency, Begin, End;
+        std::string Batch;
+        char Tmp[512];
+        HANDLE hOutput;
+        DWORD Written;
+        DWORD Error = 0;
+
+        hOutput = CreateFile(OutputPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hOutput == INVALID_HANDLE_VALUE) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to create %s.", OutputPath.c_str());
+                AddLogMessage(Tmp);
+                mergeRunning = false;
+                return;
+        }
+
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Begin);
+
+        // A failed write aborts the merge, as the output would have a hole
+        auto Flush = [&]() {
+                if (!Error && (!WriteFile(hOutput, Batch.data(), (DWORD)Batch.size(), &Written, NULL) || Written != Batch.size())) {
+                        Error = GetLastError();
+                        if (!Error) {
+                                Error = ERROR_WRITE_FAULT;
+                        }
+                        mergeAbort = true;
+                }
+                Batch.clear();
+        };
+
+        MergeRecordings(Merge, Files, mergeAbort, [&](const DMR_Event_t &Event) {
+                AnalyticsUpdate(Analytics, Event);
+                FormatJson(Event, Batch);
+                if (Batch.size() >= SINK_BATCH_BYTES) {
+                        Flush();
+                }
+        });
+        if (Batch.size()) {
+                Flush();
+        }
+        CloseHandle(hOutput);
+
+        QueryPerformanceCounter(&End);
+
+        if (Error) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to write to %s (%lu).", OutputPath.c_str(), Error);
+                AddLogMessage(Tmp);
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "Merge%s: %llu events from %zu recordings to %s in %.3f ms, at most %zu open, %llu late.",
+                mergeAbort ? " aborted" : "", Merge.Events, Files.size(), OutputPath.c_str(),
+                (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart, Merge.MaxOpen, Merge.Late);
+        AddLogMessage(Tmp);
+        AnalyticsCollect(Analytics, Analytics.LastTime, -1, Report);
+        AnalyticsReport(Report, ANALYTICS_TOP);
+        mergeRunning = false;
+}
+
+// Expands a path that may contain wildcards, keeping only valid recordings
+static void MergeAddFiles(const std::string &Pattern, std::vector<DMR_MergeFile_t> &Files)
+{
+        const size_t Slash = Pattern.find_last_of("\\/");
+        const std::string Directory = (Slash == std::string::npos) ? "" : Pattern.substr(0, Slash + 1);
+        WIN32_FIND_DATA Data;
+        HANDLE hFind;
+
+        hFind = FindFirstFile(Pattern.c_str(), &Data);
+        if (hFind == INVALID_HANDLE_VALUE) {
+                return;
+        }
+
+        do {
+                DMR_RecordingHeader_t Header;
+                DMR_RecordingChunk_t Chunk;
+                DMR_MergeFile_t File;
+                HANDLE hFile;
+                DWORD Read;
+
+                if (Data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                        continue;
+                }
+
+                File.Path = Directory + Data.cFileName;
+                hFile = CreateFile(File.Path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (hFile == INVALID_HANDLE_VALUE) {
+                        continue;
+                }
+                if (MergeReadHeader(hFile, Header) && ReadFile(hFile, &Chunk, sizeof(Chunk), &Read, NULL) && Read == sizeof(Chunk)) {
+                        File.StartTime = Chunk.Time;
+                        Files.push_back(File);
+                }
+                CloseHandle(hFile);
+        } while (FindNextFile(hFind, &Data));
+
+        FindClose(hFind);
+}
+
+// Capture thread function
+static void CaptureThread(void)
+{
+        const int BUFFER_SIZE = 1024;
+        static uint8_t Buffer[BUFFER_SIZE];
+
+        while (isCapturing && !bQuitting) {
+                DWORD bytesRead = 0;
+
+                if (!ReadFile(hComPort, Buffer, BUFFER_SIZE, &bytesRead, NULL)) {
+                        DWORD error = GetLastError();
+
+                        if (bQuitting || !isCapturing) {
+                                break;
+                        }
+                        if (error != ERROR_IO_PENDING) {
+                                char Tmp[256];
+                                sprintf_s(Tmp, sizeof(Tmp), "Error reading from COM port (0x%08X).", error);
+                                AddLogMessage(Tmp);
+                                break;
+                        }
+                        continue;
+                }
+
+                if (bytesRead > 0) {
+                        const uint64_t Time = GetTimeStamp();
+                        bool haveMessage = true;
+                        std::string message;
+
+                        RecorderAppend(recorder, Buffer, bytesRead, Time);
+                        liveDecoder.Buffer.insert(liveDecoder.Buffer.end(), Buffer, Buffer + bytesRead);
+
+                        while (haveMessage) {
+                                auto result = ScanForFrames(liveDecoder, Time, DispatchEvent);
+
+                                haveMessage = result.first;
+                                message = result.second;
+
+                                if (haveMessage && message.length() > 0) {
+                                        AddLogMessage(message);
+                                }
+                        }
+                } else {
+                        RecorderTick(recorder, GetTimeStamp());
+                }
+        }
+}
+
+static void ScanComPorts(void)
+{
+        SP_DEVINFO_DATA devData;
+        DWORD i;
+
+        // Clear the current list
+        ComboBox_ResetContent(hComPortList);
+
+        // Get a list of all COM ports
+        HDEVINFO hDevInfo = SetupDiGetClassDevs(&GUID_DEVCLASS_PORTS, 0, 0, DIGCF_PRESENT);
+        if (hDevInfo == INVALID_HANDLE_VALUE) {
+                AddLogMessage("Error: Failed to get device information.");
+                return;
+        }
+
+        devData.cbSize = sizeof(SP_DEVINFO_DATA);
+
+        // Enumerate all COM ports
+        for (i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &devData); i++) {
+                char friendlyName[256] = { 0 };
+                DWORD dataType = 0;
+                DWORD size = sizeof(friendlyName);
+
+                // Get the friendly name of the device
+                if (SetupDiGetDeviceRegistryProperty(hDevInfo, &devData, SPDRP_FRIENDLYNAME,
+                        &dataType, (PBYTE)friendlyName, size, &size)) {
+                        std::string portName = friendlyName;
+                        size_t startPos = portName.find("(COM");
+                        size_t endPos = portName.find(")", startPos);
+
+                        if (startPos != std::string::npos && endPos != std::string::npos) {
+                                std::string comPort = portName.substr(startPos + 1, endPos - startPos - 1);
+                                ComboBox_AddString(hComPortList, comPort.c_str());
+                        }
+                }
+        }
+
+        SetupDiDestroyDeviceInfoList(hDevInfo);
+
+        if (ComboBox_GetCount(hComPortList) > 0) {
+                ComboBox_SetCurSel(hComPortList, 0);
+                AddLogMessage("COM ports refreshed.");
+        } else {
+                AddLogMessage("No COM ports found.");
+        }
+}
+
+static void StartCapture(void)
+{
+        char Tmp[256];
+        char portName[32];
+        DCB dcb;
+        COMMTIMEOUTS timeouts;
+
+        if (isCapturing) {
+                return;
+        }
+
+        ComboBox_GetText(hComPortList, portName, sizeof(portName));
+
+        // Open the COM port
+        std::string fullPortName = "\\\\.\\";
+        fullPortName += portName;
+
+        hComPort = CreateFile(
+                fullPortName.c_str(),
+                GENERIC_READ,
+                0,
+                NULL,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                NULL);
+
+        if (hComPort == INVALID_HANDLE_VALUE) {
+                DWORD error = GetLastError();
+
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to open COM port (0x%08X).", error);
+                AddLogMessage(Tmp);
+                return;
+        }
+
+        memset(&dcb, 0, sizeof(dcb));
+        dcb.DCBlength = sizeof(dcb);
+
+        if (!GetCommState(hComPort, &dcb)) {
+                AddLogMessage("Error: Failed to get COM port state.");
+                CloseHandle(hComPort);
+                hComPort = INVALID_HANDLE_VALUE;
+                return;
+        }
+
+        dcb.BaudRate = CBR_115200;
+        dcb.ByteSize = 8;
+        dcb.Parity = NOPARITY;
+        dcb.StopBits = ONESTOPBIT;
+        dcb.fBinary = TRUE;
+        dcb.fErrorChar = FALSE;
+        dcb.fNull = FALSE;
+        dcb.fOutX = FALSE;
+        dcb.fInX = FALSE;
+        dcb.fDtrControl = 0;
+
+        if (!SetCommState(hComPort, &dcb)) {
+                AddLogMessage("Error: Failed to set COM port state.");
+                CloseHandle(hComPort);
+                hComPort = INVALID_HANDLE_VALUE;
+                return;
+        }
+
+        if (!SetupComm(hComPort, 8192, 8192)) {
+                AddLogMessage("Error: Failed to setup queues.\n");
+                CloseHandle(hComPort);
+                hComPort = INVALID_HANDLE_VALUE;
+                return;
+        }
 
-                                        Longitude &= 0x1FFFFFF;
-                                        Longitude <<= 7;
-                                        Longitude >>= 7;
-                                        Latitude &= 0xFFFFFF;
-                                        Latitude <<= 8;
-                                        Latitude >>= 8;
+        timeouts.ReadIntervalTimeout = 20;
+        timeouts.ReadTotalTimeoutConstant = 50;
+        timeouts.ReadTotalTimeoutMultiplier = 0;
+        timeouts.WriteTotalTimeoutConstant = 0;
+        timeouts.WriteTotalTimeoutMultiplier = 0;
 
-                                        Lon = Longitude * 360;
-                                        Lat = Latitude * 180;
+        if (!SetCommTimeouts(hComPort, &timeouts)) {
+                AddLogMessage("Error: Failed to set COM port timeouts.");
+                CloseHandle(hComPort);
+                hComPort = INVALID_HANDLE_VALUE;
+                return;
+        }
 
-                                        Lon /= 33554432;
-                                        Lat /= 16777216;
+        liveDecoder.Buffer.clear();
+        memset(&liveDecoder.CurrentCall, 0, sizeof(liveDecoder.CurrentCall));
+        StateResumeCall(liveDecoder);
 
-                                        if (Lon < 0.0) {
-                                                Lon = -Lon;
-                                                LonDirection = 'W';
-                                        }
-                                        if (Lat < 0.0) {
-                                                Lat = -Lat;
-                                                LatDirection = 'S';
-                                        }
+        isCapturing = true;
+        Thread = std::make_unique<std::thread>(CaptureThread);
 
-                                        sprintf_s(pOut, OutLength, "GPS: %.6f%c %.6f%c", Lat, LatDirection, Lon, LonDirection);
-                                } else {
-                                        uint8_t i;
+        sprintf_s(Tmp, sizeof(Tmp), "Started capturing data from %s.", portName);
+        AddLogMessage(Tmp);
+}
 
-                                        sprintf_s(pOut, OutLength, "In Band:");
+static void StopCapture(void)
+{
+        if (!isCapturing) {
+                return;
+        }
 
-                                        for (i = 0; i < DataLength; i++) {
-                                                char Tmp[8];
+        // Signal the thread to stop
+        isCapturing = false;
+        Sleep(250);
 
-                                                sprintf_s(Tmp, sizeof(Tmp), " %02X", pFrame->Data[i]);
-                                                strcat_s(pOut, OutLength, Tmp);
-                                        }
-                                }
-                                break;
+        // Wait for the thread to finish
+        if (Thread && Thread->joinable()) {
+                Thread->join();
+                Thread.reset();
+        }
 
-                        case 0x62:
-                                if (DataLength == 10) {
-                                        sprintf_s(pOut, OutLength, "Detected %s call from %02X%02X%02X%02X to %02X%02X%02X%02X in CC%d",
-                                                (pFrame->Data[0] == 0x01) ? "Private" : ((pFrame->Data[0] == 0x02) ? "Group" : "All"),
-                                                pFrame->Data[5], pFrame->Data[6], pFrame->Data[7], pFrame->Data[8],
-                                                pFrame->Data[1], pFrame->Data[2], pFrame->Data[3], pFrame->Data[4],
-                                                pFrame->Data[9]
-                                        );
-                                }
-                                break;
+        // Close the COM port
+        if (hComPort != INVALID_HANDLE_VALUE) {
+                CloseHandle(hComPort);
+                hComPort = INVALID_HANDLE_VALUE;
+        }
 
-                        case 0x81:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength >= 7) {
-                                                size_t i, KeyLength = 0;
+        ArchiveFlush(archive);
 
-                                                sprintf_s(pOut, OutLength, "Set key: Seq %d, ", pFrame->Data[0]);
+        {
+                std::lock_guard<std::mutex> lock(analyticsMutex);
+                AnalyticsClose(analytics, GetTimeStamp());
+        }
 
-                                                switch (pFrame->Data[1]) {
-                                                case 0x00:
-                                                        strcat_s(pOut, OutLength, "OFF");
-                                                        break;
+        // Save a pending flight recorder snapshot with whatever followed the trigger
+        if (recorder.TriggerTime) {
+                RecorderSnapshot(recorder);
+        }
 
-                                                case 0x01:
-                                                        strcat_s(pOut, OutLength, "ARC =");
-                                                        KeyLength = 5;
-                                                        break;
+        AddLogMessage("Stopped capturing data.");
+}
 
-                                                case 0x04:
-                                                        strcat_s(pOut, OutLength, "AES128 =");
-                                                        KeyLength = 16;
-                                                        break;
+static uint64_t ParseTime(const char *pText, bool bEnd)
+{
+        tm ti;
+        time_t Time;
+
+        memset(&ti, 0, sizeof(ti));
+        ti.tm_isdst = -1;
+
+        switch (sscanf_s(pText, "%d-%d-%dT%d:%d:%d", &ti.tm_year, &ti.tm_mon, &ti.tm_mday, &ti.tm_hour, &ti.tm_min, &ti.tm_sec)) {
+        case 3:
+                if (bEnd) {
+                        ti.tm_hour = 23;
+                        ti.tm_min = 59;
+                        ti.tm_sec = 59;
+                }
+                break;
 
-                                                case 0x05:
-                                                        strcat_s(pOut, OutLength, "AES256 =");
-                                                        KeyLength = 32;
-                                                        break;
-                                                }
+        case 5:
+        case 6:
+                break;
 
-                                                if (!KeyLength) {
-                                                        pOut[0] = 0;
-                                                        break;
-                                                }
+        default:
+                return 0;
+        }
 
-                                                for (i = 0; i < KeyLength && i < DataLength - 2; i++) {
-                                                        char Hex[4];
+        ti.tm_year -= 1900;
+        ti.tm_mon -= 1;
+        Time = mktime(&ti);
+        if (Time == -1) {
+                return 0;
+        }
 
-                                                        sprintf_s(Hex, sizeof(Hex), " %02X", pFrame->Data[2 + i]);
-                                                        strcat_s(pOut, OutLength, Hex);
-                                                }
-                                        }
-                                }
-                                break;
+        return (uint64_t)Time * 1000 + (bEnd ? 999 : 0);
+}
 
-                        case 0x82:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength == 20) {
-                                                const uint32_t RX = (pFrame->Data[3] << 24) | (pFrame->Data[4] << 16) | (pFrame->Data[5] << 8) | pFrame->Data[6];
-                                                const uint32_t TX = (pFrame->Data[7] << 24) | (pFrame->Data[8] << 16) | (pFrame->Data[9] << 8) | pFrame->Data[10];
+static std::string FormatResult(const DMR_Event_t &Event)
+{
+        char TimeStamp[64];
+        char Msg[512];
+        time_t Time = (time_t)(Event.Time / 1000);
+        tm ti;
 
-                                                sprintf_s(pOut, OutLength, "Set Channel: TS%d CC%d RX %d TX %d", pFrame->Data[0], pFrame->Data[1], RX, TX);
-                                        }
-                                }
-                                break;
+        localtime_s(&ti, &Time);
+        strftime(TimeStamp, sizeof(TimeStamp), "%Y-%m-%d %H:%M:%S ", &ti);
+        FormatEvent(Event, Msg, sizeof(Msg));
 
-                        case 0x84:
-                                if (pFrame->RW == DMR_RW_TO_DMR) {
-                                        if (DataLength >= 5) {
-                                                size_t i = pFrame->Data[0];
+        return std::string(TimeStamp) + Msg;
+}
 
-                                                strcat_s(pOut, OutLength, "Set group list:");
-                                                for (i = 0; i < pFrame->Data[0] && i < DataLength - 1; i++) {
-                                                        char Group[16];
+static void StateReport(DMR_State_t &State, uint32_t Id)
+{
+        const DMR_Station_t *pStation;
+        char Tmp[512];
 
-                                                        sprintf_s(Group, sizeof(Group), " %d", GetId(&pFrame->Data[(i * 4) + 1]));
-                                                        strcat_s(pOut, OutLength, Group);
-                                                }
-                                        } else {
-                                                strcat_s(pOut, OutLength, "Cleared group list");
-                                        }
-                                }
-                                break;
+        std::lock_guard<std::mutex> lock(State.Mutex);
 
-                        default:
-                                for (size_t i = 0; i < 9 + DataLength; i++) {
-                                        char Hex[4];
-                                        sprintf_s(Hex, sizeof(Hex), " %02X", pData[i]);
-                                        strcat_s(pOut, OutLength, Hex);
-                                }
-                                break;
-                        }
+        if (!Id) {
+                sprintf_s(Tmp, sizeof(Tmp), "State: %zu stations, %zu channel records.", State.Stations.size(), State.Events.size());
+                AddLogMessage(Tmp);
+                for (auto &Entry : State.Events) {
+                        AddLogMessage("  " + FormatResult(Entry));
+                }
+                return;
+        }
 
-                        Length = FrameLength;
+        pStation = StationFind(State, Id, false);
+        if (!pStation) {
+                sprintf_s(Tmp, sizeof(Tmp), "State: nothing known about %08u.", Id);
+                AddLogMessage(Tmp);
+                return;
+        }
+        if (pStation->AliasTime) {
+                DMR_Event_t Event = {};
+
+                Event.Time = pStation->AliasTime;
+                Event.Type = DMR_EVENT_ALIAS;
+                Event.AliasFormat = pStation->AliasFormat;
+                memcpy(Event.Alias, pStation->Alias, sizeof(pStation->Alias));
+                AddLogMessage("  " + FormatResult(Event));
+        }
+        if (pStation->bGps) {
+                DMR_Event_t Event = {};
+
+                Event.Time = pStation->GpsTime;
+                Event.Type = DMR_EVENT_GPS;
+                Event.Latitude = pStation->Latitude;
+                Event.Longitude = pStation->Longitude;
+                AddLogMessage("  " + FormatResult(Event));
+        }
+}
 
-                        return true;
+// Event i of the synthetic traffic the benchmarks use: 200 of 5000 radios
+// active at a time, calling 100 talkgroups, with aliases and GPS fixes
+static void BenchEvent(uint64_t i, uint64_t Start, DMR_Event_t &Event)
+{
+        static const char *const Words[] = { "Anna", "Bert", "Club", "Dave", "Echo", "Fox", "Gate", "Hill" };
+
+        Event.Time = Start + i * BENCH_EVENT_INTERVAL + i * 7919 % (BENCH_EVENT_INTERVAL - 10);
+        Event.Slot = (uint8_t)(1 + i % 2);
+        Event.ColorCode = 1;
+        Event.CallType = 0x02;
+        Event.Source = (uint32_t)(3100000 + (i / 50000 * 97 + i * 7919 % 200) % 5000);
+        Event.Destination = 91 + Event.Source % 100;
+
+        switch (i % 8) {
+        case 0:
+        case 3:
+                Event.Type = DMR_EVENT_CALL_START;
+                break;
+        case 1:
+        case 4:
+                Event.Type = DMR_EVENT_CALL_END;
+                break;
+        case 2:
+        case 5:
+                Event.Type = DMR_EVENT_DETECTED;
+                break;
+        case 6:
+                Event.Type = DMR_EVENT_ALIAS;
+                Event.Count = (uint8_t)sprintf_s(Event.Alias, sizeof(Event.Alias), "%s %s %u", Words[Event.Source % 8], Words[Event.Source / 8 % 8], Event.Source);
+                break;
+        default:
+                Event.Type = DMR_EVENT_GPS;
+                Event.Latitude = (int32_t)(0x250000 + Event.Source % 4096 * 16 + i % 16);
+                Event.Longitude = (int32_t)(0x0A0000 + Event.Source % 8192 * 8 + i % 16);
+                break;
+        }
+}
+
+// Times archiving Count synthetic events to scratch files, their size and a query of one ID
+static void ArchiveBench(size_t Count)
+{
+        DMR_Archive_t Bench = { ARCHIVE_BENCH_DATA_FILE, ARCHIVE_BENCH_INDEX_FILE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+        const uint64_t Start = GetTimeStamp();
+        DMR_ArchiveQuery_t Query = {};
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        uint64_t Text = 0;
+        size_t Matches = 0;
+        size_t Lines = 0;
+        size_t Scanned, i;
+        double Data, Index;
+        char Tmp[256];
+
+        DeleteFile(ARCHIVE_BENCH_DATA_FILE);
+        DeleteFile(ARCHIVE_BENCH_INDEX_FILE);
+        ArchiveOpen(Bench);
+        if (Bench.hData == INVALID_HANDLE_VALUE) {
+                return;
+        }
+
+        QueryPerformanceFrequency(&Frequency);
+
+        QueryPerformanceCounter(&Begin);
+        for (i = 0; i < Count && !bQuitting; i++) {
+                BenchEvent(i, Start, Event);
+                ArchiveAppend(Bench, Event);
+                // Blocks are dropped when the writer falls behind, so wait for it before its queue fills
+                if ((i + 1) % (ARCHIVE_BLOCK_EVENTS * ARCHIVE_QUEUE_BLOCKS / 2) == 0) {
+                        ArchiveFlush(Bench);
                 }
         }
+        ArchiveFlush(Bench);
+        QueryPerformanceCounter(&End);
+        Count = i;
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu events archived, %.1f ns per event, %llu events lost.", Count,
+                Count ? (double)(End.QuadPart - Begin.QuadPart) * 1e9 / Frequency.QuadPart / Count : 0.0, Bench.Lost);
+        AddLogMessage(Tmp);
 
-        Length = 0;
+        // Every 64th event is enough for the size of the text
+        for (i = 0; i < Count; i += 64) {
+                BenchEvent(i, Start, Event);
+                Text += FormatResult(Event).size() + 2;
+                Lines++;
+        }
+        Data = Count ? (double)Bench.Size / Count : 0.0;
+        Index = Count ? (double)(Bench.Entries.size() * sizeof(DMR_ArchiveIndex_t)) / Count : 0.0;
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %.2f bytes per event and %.2f of index, against %.1f bytes of text, %.1fx smaller.", Data, Index,
+                Lines ? (double)Text / Lines : 0.0, (Lines && Count) ? (double)Text / Lines / (Data + Index) : 0.0);
+        AddLogMessage(Tmp);
 
-        return false;
+        if (Count) {
+                BenchEvent(Count / 2, Start, Event);
+                Query.From = Event.Time - 60 * 60 * 1000;
+                Query.To = Event.Time + 60 * 60 * 1000;
+                Query.Source = Event.Source;
+                QueryPerformanceCounter(&Begin);
+                Scanned = ArchiveQuery(Bench, Query, [&Matches](const DMR_Event_t &) {
+                        Matches++;
+                });
+                QueryPerformanceCounter(&End);
+                sprintf_s(Tmp, sizeof(Tmp), "Bench: query of src=%u over two hours, %zu events matched, %zu of %zu blocks read, %.3f ms.", Query.Source,
+                        Matches, Scanned, Bench.Entries.size(), (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart);
+                AddLogMessage(Tmp);
+        }
+
+        ArchiveClose(Bench);
+        DeleteFile(ARCHIVE_BENCH_DATA_FILE);
+        DeleteFile(ARCHIVE_BENCH_INDEX_FILE);
 }
 
-static std::pair<bool, std::string> ScanForFrames(std::vector<uint8_t> &buffer)
+// Times one writer and Readers readers on a private ring of the same layout
+static void RingBench(size_t Readers, size_t Count)
 {
+        const uint64_t Size = sizeof(DMR_RingHeader_t) + (uint64_t)RING_SLOT_COUNT * sizeof(DMR_RingSlot_t);
+        std::vector<DMR_Event_t> Events(RING_SLOT_COUNT);
+        std::vector<std::thread> Threads;
+        std::vector<uint64_t> Read(Readers), Lost(Readers);
+        std::vector<LONGLONG> Ticks(Readers);
+        std::atomic<bool> bDone(false);
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_RingHeader_t *pHeader;
+        uint8_t Frame[32] = {};
+        HANDLE hSection;
+        char Tmp[256];
         size_t i;
 
-        while (buffer.size()) {
-                for (i = 0; i < buffer.size(); i++) {
-                        if (buffer[i] == DMR_FRAME_HEAD) {
-                                break;
-                        }
+        hSection = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(Size >> 32), (DWORD)Size, NULL);
+        pHeader = hSection ? (DMR_RingHeader_t *)MapViewOfFile(hSection, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)Size) : NULL;
+        if (!pHeader) {
+                AddLogMessage("Error: Failed to create the benchmark ring.");
+                if (hSection) {
+                        CloseHandle(hSection);
                 }
+                return;
+        }
+        pHeader->Magic = RING_MAGIC;
+        pHeader->Version = RING_VERSION;
+        pHeader->SlotCount = RING_SLOT_COUNT;
+        pHeader->SlotSize = sizeof(DMR_RingSlot_t);
+
+        // Generated up front, so the writer's time is the ring's alone
+        for (i = 0; i < Events.size(); i++) {
+                BenchEvent(i, GetTimeStamp(), Events[i]);
+        }
 
-                if (i) {
-                        buffer.erase(buffer.begin(), buffer.begin() + i);
-                }
+        QueryPerformanceFrequency(&Frequency);
+
+        for (i = 0; i < Readers; i++) {
+                Threads.emplace_back([&, i] {
+                        DMR_RingRecord_t Record;
+                        LARGE_INTEGER Start, Stop;
+                        uint64_t Next = 1;
+                        uint64_t Records = 0;
+                        uint64_t Missed = 0;
+                        uint64_t Skipped;
+
+                        QueryPerformanceCounter(&Start);
+                        for (;;) {
+                                const bool bLast = bDone.load(std::memory_order_acquire);
+                                const bool bRead = RingRead(pHeader, &Next, Record, Skipped);
+
+                                Missed += Skipped;
+                                if (bRead) {
+                                        Records++;
+                                } else if (bLast) {
+                                        break;
+                                } else {
+                                        std::this_thread::yield();
+                                }
+                        }
+                        QueryPerformanceCounter(&Stop);
 
-                if (!buffer.size() || buffer[0] == DMR_FRAME_HEAD) {
-                        break;
+                        Read[i] = Records;
+                        Lost[i] = Missed;
+                        Ticks[i] = Stop.QuadPart - Start.QuadPart;
+                });
+        }
+
+        QueryPerformanceCounter(&Begin);
+        for (i = 0; i < Count && !bQuitting; i++) {
+                RingWrite(pHeader, Events[i % Events.size()], Frame, sizeof(Frame));
+        }
+        QueryPerformanceCounter(&End);
+        Count = i;
+        bDone.store(true, std::memory_order_release);
+        for (auto &Thread : Threads) {
+                Thread.join();
+        }
+
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu ring records written with %zu readers, %.1f ns per record.", Count, Readers,
+                Count ? (double)(End.QuadPart - Begin.QuadPart) * 1e9 / Frequency.QuadPart / Count : 0.0);
+        AddLogMessage(Tmp);
+        for (i = 0; i < Readers; i++) {
+                sprintf_s(Tmp, sizeof(Tmp), "Bench: reader %zu read %llu records, %.1f ns per record, %llu lost.", i + 1, Read[i],
+                        Read[i] ? (double)Ticks[i] * 1e9 / Frequency.QuadPart / Read[i] : 0.0, Lost[i]);
+                AddLogMessage(Tmp);
+        }
+
+        UnmapViewOfFile(pHeader);
+        CloseHandle(hSection);
+}
+
+// Counts the records of an export file, false if one is cut short or malformed
+static bool SinkCheckFile(const DMR_SinkFormat_t *pFormat, const std::string &Path, uint64_t &Records)
+{
+        const bool bJson = !pFormat->pHeader;
+        const size_t HeaderLength = bJson ? 0 : strlen(pFormat->pHeader);
+        const size_t Fields = bJson ? 0 : std::count(pFormat->pHeader, pFormat->pHeader + HeaderLength, ',') + 1;
+        std::string Data;
+        LARGE_INTEGER Size;
+        size_t Start = HeaderLength;
+        HANDLE hFile;
+        DWORD Read;
+        bool bRead;
+
+        hFile = CreateFile(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+                return false;
+        }
+        GetFileSizeEx(hFile, &Size);
+        Data.resize((size_t)Size.QuadPart);
+        bRead = Data.empty() || (ReadFile(hFile, &Data[0], (DWORD)Data.size(), &Read, NULL) && Read == Data.size());
+        CloseHandle(hFile);
+        if (!bRead || Data.compare(0, HeaderLength, bJson ? "" : pFormat->pHeader)) {
+                return false;
+        }
+
+        while (Start < Data.size()) {
+                const size_t End = Data.find('\n', Start);
+                bool bQuoted = false;
+                size_t Commas = 0;
+                int Depth = 0;
+                size_t i;
+
+                if (End == std::string::npos || End == Start) {
+                        return false;
+                }
+                for (i = Start; i < End; i++) {
+                        const char c = Data[i];
+
+                        if (bQuoted) {
+                                if (c == '\\' && bJson) {
+                                        i++;
+                                } else if (c == '"') {
+                                        bQuoted = false;
+                                }
+                        } else if (c == '"') {
+                                bQuoted = true;
+                        } else if (c == '{' || c == '[') {
+                                Depth++;
+                        } else if (c == '}' || c == ']') {
+                                Depth--;
+                        } else if (c == ',' && !Depth) {
+                                Commas++;
+                        }
+                }
+                if (bQuoted || Depth) {
+                        return false;
+                }
+                if (bJson ? (Data[Start] != '{' || Data[End - 1] != '}') : (Data[End - 1] != '\r' || Commas + 1 != Fields)) {
+                        return false;
                 }
+
+                Records++;
+                Start = End + 1;
         }
 
-        if (!buffer.size()) {
-                return { false, "" };
+        return true;
+}
+
+static void SinkBenchDelete(void)
+{
+        WIN32_FIND_DATA Data;
+        HANDLE hFind;
+
+        hFind = FindFirstFile(SINK_BENCH_PREFIX "-*", &Data);
+        if (hFind == INVALID_HANDLE_VALUE) {
+                return;
         }
+        do {
+                DeleteFile(Data.cFileName);
+        } while (FindNextFile(hFind, &Data));
+        FindClose(hFind);
+}
 
-        char Msg[512];
-        size_t Length = buffer.size();
-        bool Success;
+// Streams Count synthetic events through rotating sinks, then parses the files back
+static void SinkBench(size_t Count)
+{
+        const uint64_t Start = GetTimeStamp();
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        char Tmp[256];
+        size_t i;
 
-        Success = ProcessMessage(buffer.data(), Length, Msg, sizeof(Msg));
-        if (Length) {
-                buffer.erase(buffer.begin(), buffer.begin() + Length);
+        QueryPerformanceFrequency(&Frequency);
+        SinkBenchDelete();
+
+        for (auto &Format : sinkFormats) {
+                const std::string Pattern = std::string(SINK_BENCH_PREFIX "-*.") + Format.pExtension;
+                std::unique_ptr<DMR_Sink_t> pSink = SinkCreate(&Format, SINK_BENCH_PREFIX, SINK_SYNC_INTERVAL, SINK_BENCH_SIZE, SINK_BENCH_TIME);
+                WIN32_FIND_DATA Data;
+                uint64_t Records = 0;
+                size_t Files = 0;
+                size_t Bad = 0;
+                size_t Parts = 0;
+                HANDLE hFind;
+                double Seconds;
+
+                QueryPerformanceCounter(&Begin);
+                for (i = 0; i < Count && !bQuitting; i++) {
+                        BenchEvent(i, Start, Event);
+                        while (!SinkQueue(*pSink, Event)) {
+                                std::this_thread::yield();
+                        }
+                }
+                SinkJoin(*pSink);
+                QueryPerformanceCounter(&End);
+
+                Seconds = (double)(End.QuadPart - Begin.QuadPart) / Frequency.QuadPart;
+                sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu events exported as %s, %.0f events per second, %llu write errors.", i, Format.pExtension,
+                        Seconds > 0 ? i / Seconds : 0.0, pSink->Failed);
+                AddLogMessage(Tmp);
+
+                hFind = FindFirstFile(Pattern.c_str(), &Data);
+                if (hFind != INVALID_HANDLE_VALUE) {
+                        do {
+                                Files++;
+                                if (!SinkCheckFile(&Format, Data.cFileName, Records)) {
+                                        Bad++;
+                                }
+                        } while (FindNextFile(hFind, &Data));
+                        FindClose(hFind);
+                }
+                hFind = FindFirstFile((Pattern + ".part").c_str(), &Data);
+                if (hFind != INVALID_HANDLE_VALUE) {
+                        do {
+                                Parts++;
+                        } while (FindNextFile(hFind, &Data));
+                        FindClose(hFind);
+                }
+
+                sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu %s files hold %llu of %zu events, %zu failed to parse, %zu .part files left.", Files, Format.pExtension,
+                        Records, i, Bad, Parts);
+                AddLogMessage(Tmp);
         }
 
-        return { Success, Msg };
+        SinkBenchDelete();
 }
 
-// Capture thread function
-static void CaptureThread(void)
+// Publishes Count synthetic events to a loopback subscriber on a publisher of its own
+static void PublisherBench(size_t Count)
 {
-        const int BUFFER_SIZE = 1024;
-        static uint8_t Buffer[BUFFER_SIZE];
+        const uint64_t Start = GetTimeStamp();
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        std::atomic<bool> bDone(false);
+        std::thread Receiver;
+        uint64_t Received = 0;
+        uint64_t Sent = 0;
+        uint64_t Dropped = 0;
+        LONGLONG Latency = 0;
+        LONGLONG MaxLatency = 0;
+        bool bSubscribed = false;
+        sockaddr_in Address;
+        SOCKET Socket;
+        char Tmp[256];
+        size_t i;
 
-        while (isCapturing && !bQuitting) {
-                DWORD bytesRead = 0;
+        if (publishThread) {
+                AddLogMessage("Error: Stop the publisher first, its subscribers would get the benchmark's events.");
+                return;
+        }
+        PublisherStart(0, NULL);
+        if (!publishThread) {
+                return;
+        }
+
+        memset(&Address, 0, sizeof(Address));
+        Address.sin_family = AF_INET;
+        Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Address.sin_port = htons(publishPort);
+        Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (Socket == INVALID_SOCKET || connect(Socket, (const sockaddr *)&Address, sizeof(Address)) == SOCKET_ERROR || send(Socket, "binary\n", 7, 0) != 7) {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to connect the benchmark subscriber (%d).", WSAGetLastError());
+                AddLogMessage(Tmp);
+                if (Socket != INVALID_SOCKET) {
+                        closesocket(Socket);
+                }
+                PublisherStop();
+                return;
+        }
 
-                if (!ReadFile(hComPort, Buffer, BUFFER_SIZE, &bytesRead, NULL)) {
-                        DWORD error = GetLastError();
+        // Events published before the request line is parsed would pass the subscriber by
+        for (i = 0; i < 1000 && !bSubscribed; i++) {
+                Sleep(1);
+                std::lock_guard<std::mutex> lock(subscriberMutex);
+                for (auto &pSubscriber : subscribers) {
+                        bSubscribed |= pSubscriber->bSubscribed;
+                }
+        }
 
-                        if (bQuitting || !isCapturing) {
-                                break;
+        QueryPerformanceFrequency(&Frequency);
+        QueryPerformanceCounter(&Begin);
+        End = Begin;
+
+        // Counts the length prefixed records until a second passes without data after the last event
+        Receiver = std::thread([&] {
+                std::vector<char> Buffer(PUBLISH_SEND_BATCH);
+                size_t Skip = 0;
+                size_t Length = 0;
+                int Header = 0;
+
+                for (;;) {
+                        fd_set Read;
+                        timeval Timeout = { 1, 0 };
+                        int Bytes, p;
+
+                        FD_ZERO(&Read);
+                        FD_SET(Socket, &Read);
+                        if (select(0, &Read, NULL, NULL, &Timeout) <= 0) {
+                                if (bDone) {
+                                        break;
+                                }
+                                continue;
                         }
-                        if (error != ERROR_IO_PENDING) {
-                                char Tmp[256];
-                                sprintf_s(Tmp, sizeof(Tmp), "Error reading from COM port (0x%08X).", error);
-                                AddLogMessage(Tmp);
+                        Bytes = recv(Socket, Buffer.data(), (int)Buffer.size(), 0);
+                        if (Bytes <= 0) {
                                 break;
                         }
-                        continue;
-                }
-
-                if (bytesRead > 0) {
-                        bool haveMessage = true;
-                        std::string message;
+                        QueryPerformanceCounter(&End);
 
-                        dataBuffer.insert(dataBuffer.end(), Buffer, Buffer + bytesRead);
+                        for (p = 0; p < Bytes;) {
+                                if (Skip) {
+                                        const size_t Take = (Skip < (size_t)(Bytes - p)) ? Skip : (size_t)(Bytes - p);
 
-                        while (haveMessage) {
-                                auto result = ScanForFrames(dataBuffer);
+                                        Skip -= Take;
+                                        p += (int)Take;
+                                        Received += !Skip;
+                                        continue;
+                                }
+                                Length |= (size_t)(uint8_t)Buffer[p++] << (8 * Header);
+                                if (++Header == 2) {
+                                        Skip = Length;
+                                        Received += !Skip;
+                                        Length = 0;
+                                        Header = 0;
+                                }
+                        }
+                }
+        });
 
-                                haveMessage = result.first;
-                                message = result.second;
+        for (i = 0; i < Count && !bQuitting; i++) {
+                bool bFull = true;
 
-                                if (haveMessage && message.length() > 0) {
-                                        AddLogMessage(message);
+                BenchEvent(i, Start, Event);
+                // Keep to what the subscriber takes, so the rate is one it can sustain
+                while (bFull) {
+                        {
+                                std::lock_guard<std::mutex> lock(publishMutex);
+                                bFull = publishInbox.size() >= PUBLISH_QUEUE_LIMIT / 2;
+                        }
+                        if (!bFull && !(i % 256)) {
+                                std::lock_guard<std::mutex> lock(subscriberMutex);
+                                for (auto &pSubscriber : subscribers) {
+                                        bFull |= pSubscriber->Queue.size() >= PUBLISH_QUEUE_LIMIT / 2;
                                 }
                         }
+                        if (bFull) {
+                                std::this_thread::yield();
+                        }
+                }
+                PublishEvent(Event);
+        }
+        bDone = true;
+        Receiver.join();
+
+        {
+                std::lock_guard<std::mutex> lock(subscriberMutex);
+                for (auto &pSubscriber : subscribers) {
+                        Sent += pSubscriber->Sent;
+                        Dropped += pSubscriber->Dropped;
+                        Latency += pSubscriber->Latency;
+                        if (pSubscriber->MaxLatency > MaxLatency) {
+                                MaxLatency = pSubscriber->MaxLatency;
+                        }
                 }
         }
+        closesocket(Socket);
+        PublisherStop();
+
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: %zu events published, %llu received by a loopback subscriber, %.0f events per second, %llu dropped.", i, Received,
+                (End.QuadPart > Begin.QuadPart) ? Received * (double)Frequency.QuadPart / (End.QuadPart - Begin.QuadPart) : 0.0, Dropped);
+        AddLogMessage(Tmp);
+        sprintf_s(Tmp, sizeof(Tmp), "Bench: publisher latency avg %.3f ms max %.3f ms.", Sent ? (double)Latency * 1000.0 / Frequency.QuadPart / Sent : 0.0,
+                (double)MaxLatency * 1000.0 / Frequency.QuadPart);
+        AddLogMessage(Tmp);
 }
 
-static void ScanComPorts(void)
+// Appends a frame as the radio sends it
+static void BenchFrame(std::vector<uint8_t> &Out, uint8_t Command, uint8_t RW, const uint8_t *pData, uint8_t Length)
 {
-        SP_DEVINFO_DATA devData;
-        DWORD i;
-
-        // Clear the current list
-        ComboBox_ResetContent(hComPortList);
+        const size_t Start = Out.size();
+        const uint8_t Header[] = { DMR_FRAME_HEAD, Command, RW, 0, 0xFF, 0xFF, 0, Length };
+        uint16_t Sum;
 
-        // Get a list of all COM ports
-        HDEVINFO hDevInfo = SetupDiGetClassDevs(&GUID_DEVCLASS_PORTS, 0, 0, DIGCF_PRESENT);
-        if (hDevInfo == INVALID_HANDLE_VALUE) {
-                AddLogMessage("Error: Failed to get device information.");
-                return;
-        }
+        Out.insert(Out.end(), Header, Header + sizeof(Header));
+        Out.insert(Out.end(), pData, pData + Length);
+        Out.push_back(DMR_FRAME_TAIL);
 
-        devData.cbSize = sizeof(SP_DEVINFO_DATA);
+        Sum = GenCheckSum(Out.data() + Start, Out.size() - Start);
+        Out[Start + 4] = (uint8_t)(Sum >> 8);
+        Out[Start + 5] = (uint8_t)Sum;
+}
 
-        // Enumerate all COM ports
-        for (i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &devData); i++) {
-                char friendlyName[256] = { 0 };
-                DWORD dataType = 0;
-                DWORD size = sizeof(friendlyName);
+// The BCD form GetId() reads
+static void PutId(uint8_t *pData, uint32_t Id)
+{
+        int i;
 
-                // Get the friendly name of the device
-                if (SetupDiGetDeviceRegistryProperty(hDevInfo, &devData, SPDRP_FRIENDLYNAME,
-                        &dataType, (PBYTE)friendlyName, size, &size)) {
-                        std::string portName = friendlyName;
-                        size_t startPos = portName.find("(COM");
-                        size_t endPos = portName.find(")", startPos);
+        for (i = 3; i >= 0; i--) {
+                pData[i] = (uint8_t)((Id % 10) | (Id / 10 % 10) << 4);
+                Id /= 100;
+        }
+}
 
-                        if (startPos != std::string::npos && endPos != std::string::npos) {
-                                std::string comPort = portName.substr(startPos + 1, endPos - startPos - 1);
-                                ComboBox_AddString(hComPortList, comPort.c_str());
+// Times merging Files synthetic recordings that all overlap
+static void MergeBench(size_t Files)
+{
+        const uint64_t Start = GetTimeStamp();
+        std::vector<DMR_MergeFile_t> Recordings;
+        LARGE_INTEGER Frequency, Begin, End;
+        DMR_Event_t Event = {};
+        DMR_Merge_t Merge = {};
+        std::vector<uint8_t> Data;
+        std::string Batch;
+        char Name[MAX_PATH];
+        DWORD Written;
+        size_t i, j;
+
+        for (i = 0; i < Files && !bQuitting; i++) {
+                const DMR_RecordingHeader_t Header = { RECORDING_MAGIC, RECORDING_VERSION, (uint8_t)(i % 4), 0 };
+                HANDLE hFile;
+
+                Data.clear();
+                PutValue(Data, Header);
+                for (j = 0; j < MERGE_BENCH_CHUNKS; j++) {
+                        DMR_RecordingChunk_t Chunk;
+                        uint8_t Frame[9] = {};
+
+                        BenchEvent(j, Start + i * 1000, Event);
+                        Chunk.Time = Event.Time;
+                        Chunk.Length = (j % 2) ? sizeof(DMR_Frame_t) + 2 : sizeof(DMR_Frame_t) + 10;
+                        PutValue(Data, Chunk);
+                        if (j % 2) {
+                                BenchFrame(Data, 0x06, DMR_RW_UPLOAD, Frame, 1);
+                        } else {
+                                Frame[0] = Event.CallType;
+                                PutId(&Frame[1], Event.Destination);
+                                PutId(&Frame[5], Event.Source);
+                                BenchFrame(Data, 0x06, DMR_RW_UPLOAD, Frame, 9);
                         }
                 }
+
+                sprintf_s(Name, sizeof(Name), "DigiMonitoR-bench-merge-%03zu.dmc", i);
+                hFile = CreateFile(Name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (hFile == INVALID_HANDLE_VALUE) {
+                        break;
+                }
+                if (!WriteFile(hFile, Data.data(), (DWORD)Data.size(), &Written, NULL) || Written != Data.size()) {
+                        CloseHandle(hFile);
+                        break;
+                }
+                CloseHandle(hFile);
+        }
+        MergeAddFiles(MERGE_BENCH_PATTERN, Recordings);
+        if (Recordings.size() != Files) {
+                AddLogMessage("Error: Failed to write the benchmark recordings.");
+        } else {
+                QueryPerformanceFrequency(&Frequency);
+                QueryPerformanceCounter(&Begin);
+                MergeRecordings(Merge, Recordings, bQuitting, [&Batch](const DMR_Event_t &Event) {
+                        FormatJson(Event, Batch);
+                        if (Batch.size() >= SINK_BATCH_BYTES) {
+                                Batch.clear();
+                        }
+                });
+                QueryPerformanceCounter(&End);
+
+                sprintf_s(Name, sizeof(Name), "Bench: merged %llu events from %zu recordings in %.3f ms, %.0f events per second, at most %zu open, %llu late.",
+                        Merge.Events, Recordings.size(), (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart,
+                        (End.QuadPart > Begin.QuadPart) ? Merge.Events * (double)Frequency.QuadPart / (End.QuadPart - Begin.QuadPart) : 0.0,
+                        Merge.MaxOpen, Merge.Late);
+                AddLogMessage(Name);
         }
 
-        SetupDiDestroyDeviceInfoList(hDevInfo);
+        for (i = 0; i < Files; i++) {
+                sprintf_s(Name, sizeof(Name), "DigiMonitoR-bench-merge-%03zu.dmc", i);
+                DeleteFile(Name);
+        }
+}
 
-        if (ComboBox_GetCount(hComPortList) > 0) {
-                ComboBox_SetCurSel(hComPortList, 0);
-                AddLogMessage("COM ports refreshed.");
+// Runs a benchmark off the GUI thread; only one runs at a time
+static void BenchThread(std::vector<std::string> Args)
+{
+        const bool bCount = Args.size() >= 3;
+        char Tmp[256];
+
+        if (Args[1] == "state") {
+                StateBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : STATE_BENCH_STATIONS);
+        } else if (Args[1] == "search") {
+                SearchBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : SEARCH_BENCH_EVENTS);
+        } else if (Args[1] == "archive") {
+                ArchiveBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : ARCHIVE_BENCH_EVENTS);
+        } else if (Args[1] == "export") {
+                SinkBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : SINK_BENCH_EVENTS);
+        } else if (Args[1] == "publish") {
+                PublisherBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : PUBLISH_BENCH_EVENTS);
+        } else if (Args[1] == "merge") {
+                MergeBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : MERGE_BENCH_FILES);
+        } else if (Args[1] == "ring") {
+                RingBench(bCount ? strtoul(Args[2].c_str(), NULL, 10) : RING_BENCH_READERS,
+                        (Args.size() >= 4) ? strtoul(Args[3].c_str(), NULL, 10) : RING_BENCH_EVENTS);
         } else {
-                AddLogMessage("No COM ports found.");
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown benchmark '%s'.", Args[1].c_str());
+                AddLogMessage(Tmp);
         }
+
+        benchRunning = false;
 }
 
-static void StartCapture(void)
+// Commands typed into the command box:
+//   archive                                   Show archive statistics
+//   query [from=DATE] [to=DATE] [src=ID] [dst=ID] List archived events
+//   export jsonl|csv [off|OPTION...]          Start or stop an export sink
+//   export off                                Stop all export sinks
+//   publish [on [PORT [ADDRESS]]|off]         Control or report the event publisher (loopback by default)
+//   ring                                      Report the shared memory event ring
+//   watch [ID ...|off]                        Add, list or clear flight recorder watched IDs
+//   trigger                                   Take a flight recorder snapshot
+//   merge OUTPUT.jsonl RECORDING...           Merge recordings (wildcards allowed) by time
+//   state [ID|save]                           Report the saved state, an ID's alias and GPS, or save now
+//   bench state [N]                           Time state updates, saves and restores on N synthetic stations
+//   bench search [N]                          Time indexing and queries on N synthetic events
+//   bench archive [N]                         Time archiving and a query on N synthetic events, and their size
+//   bench ring [READERS [N]]                  Time N ring records written while READERS threads read them
+//   bench export [N]                          Time N synthetic events through rotating sinks, then check the files
+//   bench publish [N]                         Time N synthetic events through a publisher to a loopback subscriber
+//   bench merge [FILES]                       Time merging FILES overlapping synthetic recordings
+//   find WORD...|more                         Search the scrollback for events with every word, or continue
+//   discover [on|off|reset]                   Control discovery mode or report undecoded frames and their cost
+//   stats [tg|src|cc|ts|port [N]]             Report airtime, calls and busy ratio
+// The arguments are described in README.md.
+static void RunCommand(const std::string &Command)
 {
+        std::vector<std::string> Args;
         char Tmp[256];
-        char portName[32];
-        DCB dcb;
-        COMMTIMEOUTS timeouts;
+        size_t Start = 0;
 
-        if (isCapturing) {
+        while (Start < Command.length()) {
+                size_t End = Command.find(' ', Start);
+
+                if (End == std::string::npos) {
+                        End = Command.length();
+                }
+                if (End > Start) {
+                        Args.push_back(Command.substr(Start, End - Start));
+                }
+                Start = End + 1;
+        }
+        if (Args.empty()) {
                 return;
         }
 
-        ComboBox_GetText(hComPortList, portName, sizeof(portName));
-
-        // Open the COM port
-        std::string fullPortName = "\\\\.\\";
-        fullPortName += portName;
+        if (Args[0] == "archive") {
+                uint64_t Events = 0;
+                uint64_t Size, Lost;
+                size_t Blocks;
 
-        hComPort = CreateFile(
-                fullPortName.c_str(),
-                GENERIC_READ,
-                0,
-                NULL,
-                OPEN_EXISTING,
-                FILE_ATTRIBUTE_NORMAL,
-                NULL);
+                {
+                        std::lock_guard<std::mutex> lock(archive.Mutex);
+                        for (auto &Entry : archive.Entries) {
+                                Events += Entry.Count;
+                        }
+                        for (auto &Queued : archive.Queue) {
+                                Events += Queued.size();
+                        }
+                        Blocks = archive.Entries.size();
+                        Events += archive.Pending.size();
+                        Size = archive.Size;
+                        Lost = archive.Lost;
+                }
+                sprintf_s(Tmp, sizeof(Tmp), "Archive: %llu events in %zu blocks, %llu bytes, %llu events lost.", Events, Blocks, Size, Lost);
+                AddLogMessage(Tmp);
+        } else if (Args[0] == "query") {
+                DMR_ArchiveQuery_t Query = { 0, UINT64_MAX, 0, 0 };
+                LARGE_INTEGER Frequency, Begin, End;
+                size_t Matches = 0;
+                size_t Scanned;
+                size_t i;
+
+                for (i = 1; i < Args.size(); i++) {
+                        const char *pArg = Args[i].c_str();
+
+                        if (!strncmp(pArg, "from=", 5)) {
+                                Query.From = ParseTime(pArg + 5, false);
+                        } else if (!strncmp(pArg, "to=", 3)) {
+                                Query.To = ParseTime(pArg + 3, true);
+                        } else if (!strncmp(pArg, "src=", 4)) {
+                                Query.Source = strtoul(pArg + 4, NULL, 10);
+                        } else if (!strncmp(pArg, "dst=", 4)) {
+                                Query.Destination = strtoul(pArg + 4, NULL, 10);
+                        } else {
+                                sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown query argument '%s'.", pArg);
+                                AddLogMessage(Tmp);
+                                return;
+                        }
+                }
 
-        if (hComPort == INVALID_HANDLE_VALUE) {
-                DWORD error = GetLastError();
+                QueryPerformanceFrequency(&Frequency);
+                QueryPerformanceCounter(&Begin);
+                Scanned = ArchiveQuery(archive, Query, [&](const DMR_Event_t &Event) {
+                        if (Matches++ < ARCHIVE_QUERY_LINES) {
+                                AddLogMessage(FormatResult(Event));
+                        }
+                });
+                QueryPerformanceCounter(&End);
 
-                sprintf_s(Tmp, sizeof(Tmp), "Error: Failed to open COM port (0x%08X).", error);
+                sprintf_s(Tmp, sizeof(Tmp), "Query: %zu events matched, %zu blocks read, %.3f ms.", Matches, Scanned,
+                        (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart);
                 AddLogMessage(Tmp);
-                return;
-        }
+        } else if (Args[0] == "export" && Args.size() >= 2) {
+                const DMR_SinkFormat_t *pFormat = NULL;
+                uint64_t SyncInterval = SINK_SYNC_INTERVAL;
+                uint64_t RotateSize = SINK_ROTATE_SIZE;
+                uint64_t RotateTime = SINK_ROTATE_TIME;
+                bool bRunning = false;
+
+                for (auto &Format : sinkFormats) {
+                        if (Args[1] == Format.pExtension) {
+                                pFormat = &Format;
+                        }
+                }
+                if (!pFormat) {
+                        if (Args[1] == "off") {
+                                SinkStop(NULL);
+                        } else {
+                                sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown export format '%s'.", Args[1].c_str());
+                                AddLogMessage(Tmp);
+                        }
+                        return;
+                }
 
-        memset(&dcb, 0, sizeof(dcb));
-        dcb.DCBlength = sizeof(dcb);
+                if (Args.size() >= 3 && Args[2] == "off") {
+                        SinkStop(pFormat);
+                        return;
+                }
+                for (size_t i = 2; i < Args.size(); i++) {
+                        const char *pArg = Args[i].c_str();
+
+                        if (!strncmp(pArg, "sync=", 5)) {
+                                SyncInterval = strtoull(pArg + 5, NULL, 10) * 1000;
+                        } else if (!strncmp(pArg, "size=", 5)) {
+                                RotateSize = strtoull(pArg + 5, NULL, 10) * 1024 * 1024;
+                        } else if (!strncmp(pArg, "time=", 5)) {
+                                RotateTime = strtoull(pArg + 5, NULL, 10) * 60 * 1000;
+                        } else {
+                                sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown export option '%s'.", pArg);
+                                AddLogMessage(Tmp);
+                                return;
+                        }
+                }
 
-        if (!GetCommState(hComPort, &dcb)) {
-                AddLogMessage("Error: Failed to get COM port state.");
-                CloseHandle(hComPort);
-                hComPort = INVALID_HANDLE_VALUE;
-                return;
-        }
+                {
+                        std::lock_guard<std::mutex> lock(sinkMutex);
+                        for (auto &pSink : sinks) {
+                                bRunning |= pSink->pFormat == pFormat;
+                        }
+                }
+                if (bRunning) {
+                        sprintf_s(Tmp, sizeof(Tmp), "Error: The %s export is already running.", pFormat->pExtension);
+                        AddLogMessage(Tmp);
+                } else {
+                        SinkStart(pFormat, SyncInterval, RotateSize, RotateTime);
+                        sprintf_s(Tmp, sizeof(Tmp), "Started %s export (sync %llus, rotate at %lluMB or %llu min).", pFormat->pExtension,
+                                SyncInterval / 1000, RotateSize / (1024 * 1024), RotateTime / (60 * 1000));
+                        AddLogMessage(Tmp);
+                }
+        } else if (Args[0] == "publish") {
+                if (Args.size() >= 2 && Args[1] == "on") {
+                        PublisherStart((Args.size() >= 3) ? (uint16_t)atoi(Args[2].c_str()) : PUBLISH_DEFAULT_PORT,
+                                (Args.size() >= 4) ? Args[3].c_str() : NULL);
+                } else if (Args.size() >= 2 && Args[1] == "off") {
+                        PublisherStop();
+                        AddLogMessage("Stopped publishing events.");
+                } else {
+                        PublisherReport();
+                }
+        } else if (Args[0] == "merge" && Args.size() >= 3) {
+                std::vector<DMR_MergeFile_t> Files;
+                size_t i;
 
-        dcb.BaudRate = CBR_115200;
-        dcb.ByteSize = 8;
-        dcb.Parity = NOPARITY;
-        dcb.StopBits = ONESTOPBIT;
-        dcb.fBinary = TRUE;
-        dcb.fErrorChar = FALSE;
-        dcb.fNull = FALSE;
-        dcb.fOutX = FALSE;
-        dcb.fInX = FALSE;
-        dcb.fDtrControl = 0;
+                if (mergeRunning) {
+                        AddLogMessage("Error: A merge is already running.");
+                        return;
+                }
+                if (mergeThread) {
+                        mergeThread->join();
+                        mergeThread.reset();
+                }
 
-        if (!SetCommState(hComPort, &dcb)) {
-                AddLogMessage("Error: Failed to set COM port state.");
-                CloseHandle(hComPort);
-                hComPort = INVALID_HANDLE_VALUE;
-                return;
-        }
+                for (i = 2; i < Args.size(); i++) {
+                        MergeAddFiles(Args[i], Files);
+                }
+                if (Files.empty()) {
+                        AddLogMessage("Error: No recordings to merge.");
+                        return;
+                }
 
-        if (!SetupComm(hComPort, 8192, 8192)) {
-                AddLogMessage("Error: Failed to setup queues.\n");
-                CloseHandle(hComPort);
-                hComPort = INVALID_HANDLE_VALUE;
-                return;
-        }
+                sprintf_s(Tmp, sizeof(Tmp), "Merging %zu recordings into %s.", Files.size(), Args[1].c_str());
+                AddLogMessage(Tmp);
 
-        timeouts.ReadIntervalTimeout = 20;
-        timeouts.ReadTotalTimeoutConstant = 50;
-        timeouts.ReadTotalTimeoutMultiplier = 0;
-        timeouts.WriteTotalTimeoutConstant = 0;
-        timeouts.WriteTotalTimeoutMultiplier = 0;
+                mergeRunning = true;
+                mergeAbort = false;
+                mergeThread = std::make_unique<std::thread>(MergeThread, Args[1], std::move(Files));
+        } else if (Args[0] == "stats") {
+                DMR_AnalyticsReport_t Report = {};
+                int Dimension = -1;
+                int i;
+
+                for (i = 0; Args.size() >= 2 && i < DMR_ANALYTICS_DIMENSIONS; i++) {
+                        if (Args[1] == analyticsArgs[i]) {
+                                Dimension = i;
+                        }
+                }
+                if (Args.size() >= 2 && Dimension < 0) {
+                        sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown statistics '%s'.", Args[1].c_str());
+                        AddLogMessage(Tmp);
+                        return;
+                }
 
-        if (!SetCommTimeouts(hComPort, &timeouts)) {
-                AddLogMessage("Error: Failed to set COM port timeouts.");
-                CloseHandle(hComPort);
-                hComPort = INVALID_HANDLE_VALUE;
-                return;
-        }
+                {
+                        std::lock_guard<std::mutex> lock(analyticsMutex);
+                        AnalyticsCollect(analytics, isCapturing ? GetTimeStamp() : analytics.LastTime, Dimension, Report);
+                }
+                AnalyticsReport(Report, (Args.size() >= 3) ? strtoul(Args[2].c_str(), NULL, 10) : ANALYTICS_TOP);
+        } else if (Args[0] == "state") {
+                if (Args.size() >= 2 && Args[1] == "save") {
+                        {
+                                std::lock_guard<std::mutex> lock(state.Mutex);
+                                stateSave = true;
+                        }
+                        stateWake.notify_one();
+                } else {
+                        StateReport(state, (Args.size() >= 2) ? strtoul(Args[1].c_str(), NULL, 10) : 0);
+                }
+        } else if (Args[0] == "bench" && Args.size() >= 2) {
+                if (benchRunning) {
+                        AddLogMessage("Error: A benchmark is already running.");
+                        return;
+                }
+                if (benchThread) {
+                        benchThread->join();
+                        benchThread.reset();
+                }
 
-        dataBuffer.clear();
+                benchRunning = true;
+                benchThread = std::make_unique<std::thread>(BenchThread, Args);
+        } else if (Args[0] == "find" && Args.size() >= 2) {
+                std::vector<DMR_SearchDoc_t> Results;
+                LARGE_INTEGER Frequency, Begin, End;
 
-        isCapturing = true;
-        Thread = std::make_unique<std::thread>(CaptureThread);
+                if (Args[1] == "more") {
+                        if (!searchCursor) {
+                                AddLogMessage("Search: no more results.");
+                                return;
+                        }
+                } else {
+                        searchTerms.clear();
+                        if (!SearchParse(std::vector<std::string>(Args.begin() + 1, Args.end()), searchTerms)) {
+                                AddLogMessage("Error: Unknown search field.");
+                                return;
+                        }
+                        searchCursor = UINT64_MAX;
+                }
 
-        sprintf_s(Tmp, sizeof(Tmp), "Started capturing data from %s.", portName);
-        AddLogMessage(Tmp);
-}
+                QueryPerformanceFrequency(&Frequency);
+                QueryPerformanceCounter(&Begin);
+                searchCursor = SearchQuery(search, searchTerms, searchCursor, SEARCH_RESULT_LINES, Results);
+                QueryPerformanceCounter(&End);
 
-static void StopCapture(void)
-{
-        if (!isCapturing) {
-                return;
-        }
+                for (auto &Result : Results) {
+                        char TimeStamp[64];
+                        time_t Seconds = (time_t)(Result.Time / 1000);
+                        tm ti;
 
-        // Signal the thread to stop
-        isCapturing = false;
-        Sleep(250);
+                        localtime_s(&ti, &Seconds);
+                        strftime(TimeStamp, sizeof(TimeStamp), "%Y-%m-%d %H:%M:%S ", &ti);
+                        AddLogMessage(TimeStamp + Result.Text);
+                }
 
-        // Wait for the thread to finish
-        if (Thread && Thread->joinable()) {
-                Thread->join();
-                Thread.reset();
-        }
+                sprintf_s(Tmp, sizeof(Tmp), "Search: %zu events shown, newest first, %.3f ms.%s", Results.size(),
+                        (double)(End.QuadPart - Begin.QuadPart) * 1000.0 / Frequency.QuadPart,
+                        searchCursor ? " Type 'find more' for older ones." : "");
+                AddLogMessage(Tmp);
+        } else if (Args[0] == "discover") {
+                if (Args.size() >= 2 && Args[1] == "on") {
+                        profiler.bEnabled = true;
+                        AddLogMessage("Discovery mode on, undecoded frames are aggregated.");
+                } else if (Args.size() >= 2 && Args[1] == "off") {
+                        profiler.bEnabled = false;
+                        AddLogMessage("Discovery mode off.");
+                } else if (Args.size() >= 2 && Args[1] == "reset") {
+                        std::lock_guard<std::mutex> lock(profilerMutex);
+                        profiler.Profiles.clear();
+                        profiler.Frames = 0;
+                        profiler.Dropped = 0;
+                        profiler.Ticks = 0;
+                        profiler.Timed = 0;
+                        profiler.Dumps = 0;
+                        profiler.DumpTicks = 0;
+                } else {
+                        ProfileReport(profiler);
+                }
+        } else if (Args[0] == "ring") {
+                RingReport();
+        } else if (Args[0] == "watch") {
+                std::string List;
+                size_t i;
 
-        // Close the COM port
-        if (hComPort != INVALID_HANDLE_VALUE) {
-                CloseHandle(hComPort);
-                hComPort = INVALID_HANDLE_VALUE;
-        }
+                {
+                        std::lock_guard<std::mutex> lock(recorderMutex);
 
-        AddLogMessage("Stopped capturing data.");
+                        if (Args.size() >= 2 && Args[1] == "off") {
+                                recorderWatch.clear();
+                        }
+                        for (i = 1; i < Args.size() && Args[1] != "off"; i++) {
+                                recorderWatch.push_back(strtoul(Args[i].c_str(), NULL, 10));
+                        }
+                        std::sort(recorderWatch.begin(), recorderWatch.end());
+                        recorderWatch.erase(std::unique(recorderWatch.begin(), recorderWatch.end()), recorderWatch.end());
+
+                        for (auto Id : recorderWatch) {
+                                sprintf_s(Tmp, sizeof(Tmp), " %u", Id);
+                                List += Tmp;
+                        }
+                }
+                AddLogMessage("Watched IDs:" + (List.empty() ? std::string(" none") : List));
+        } else if (Args[0] == "trigger") {
+                if (!isCapturing) {
+                        AddLogMessage("Error: The flight recorder only triggers while capturing.");
+                        return;
+                }
+                recorderManual = true;
+                sprintf_s(Tmp, sizeof(Tmp), "Flight recorder triggered, snapshot follows in %d seconds.", RECORDER_POST_TIME / 1000);
+                AddLogMessage(Tmp);
+        } else {
+                sprintf_s(Tmp, sizeof(Tmp), "Error: Unknown command '%s'.", Args[0].c_str());
+                AddLogMessage(Tmp);
+        }
 }
 
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
@@ -705,6 +6182,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                         330, 10, 100, 25,
                         hWnd, (HMENU)3, hInstance, NULL);
 
+                hCommandEdit = CreateWindowEx(
+                        WS_EX_CLIENTEDGE,
+                        WC_EDIT, TEXT(""),
+                        WS_CHILD | WS_VISIBLE | ES_AUTOHSCROLL,
+                        440, 10, 250, 25,
+                        hWnd, (HMENU)4, hInstance, NULL);
+
+                hRunButton = CreateWindow(
+                        WC_BUTTON, TEXT("Run"),
+                        WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+                        700, 10, 70, 25,
+                        hWnd, (HMENU)5, hInstance, NULL);
+
                 hLogPane = CreateWindowExW(
                         WS_EX_CLIENTEDGE,
                         MSFTEDIT_CLASS,
@@ -724,12 +6214,18 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 SendMessage(hComPortList, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
                 SendMessage(hRefreshButton, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
                 SendMessage(hStartStopButton, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
+                SendMessage(hCommandEdit, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
+                SendMessage(hRunButton, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
                 SendMessage(hLogPane, WM_SETFONT, (WPARAM)hFont, MAKELPARAM(TRUE, 0));
 
                 SendMessage(hLogPane, EM_SETLIMITTEXT, 0, 0);
                 SendMessage(hLogPane, EM_SETEVENTMASK, 0, ENM_NONE);
 
                 ScanComPorts();
+                ArchiveOpen(archive);
+                RingOpen();
+                RecorderStart();
+                StateStart();
 
                 AddLogMessage("Application started. Select a COM port and click Start to begin capturing data.");
                 break;
@@ -762,6 +6258,15 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                                 }
                         }
                         break;
+
+                case 5: // Run button
+                {
+                        char Command[256];
+
+                        GetWindowText(hCommandEdit, Command, sizeof(Command));
+                        RunCommand(Command);
+                        break;
+                }
                 }
                 break;
 
@@ -769,6 +6274,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 clientWidth = LOWORD(lParam);
                 clientHeight = HIWORD(lParam);
 
+                // Stretch the command box and keep the Run button on the right
+                MoveWindow(hCommandEdit, 440, 10, clientWidth - 530, 25, TRUE);
+                MoveWindow(hRunButton, clientWidth - 80, 10, 70, 25, TRUE);
+
                 // Resize the log pane
                 MoveWindow(hLogPane, 10, 45, clientWidth - 20, clientHeight - 55, TRUE);
                 break;
@@ -778,13 +6287,32 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 if (isCapturing) {
                         StopCapture();
                 }
+                SinkStop(NULL);
+                PublisherStop();
+                RecorderStop();
+                if (mergeThread) {
+                        mergeAbort = true;
+                        mergeThread->join();
+                        mergeThread.reset();
+                }
+                if (benchThread) {
+                        benchThread->join();
+                        benchThread.reset();
+                }
+                StateStop();
+                ArchiveClose(archive);
+                RingClose();
                 PostQuitMessage(0);
                 break;
 
         case WM_LOG_MESSAGE:
         {
                 std::vector<std::string> lines;
+                GETTEXTLENGTHEX TextLength = { GTL_NUMCHARS | GTL_PRECISE, 1200 };
+                uint64_t Events;
 
+                // Events are indexed before their line is logged
+                Events = SearchCount(search);
                 {
                         std::lock_guard<std::mutex> lock(logMutex);
                         lines.swap(logQueue);
@@ -808,10 +6336,33 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                         output += "\r\n";
                 }
 
+                // Drops the oldest batches by the character positions the control gave for them,
+                // and their events from the search index
+                logLines += lines.size();
+                if (logLines >= SCROLLBACK_LINES + SCROLLBACK_TRIM) {
+                        uint64_t Trimmed = logTrimmed;
+                        uint64_t Evicted = 0;
+
+                        while (logBatches.size() && logLines > SCROLLBACK_LINES) {
+                                logLines -= logBatches.front().Lines;
+                                Trimmed = logBatches.front().End;
+                                Evicted = logBatches.front().Events;
+                                logBatches.pop_front();
+                        }
+                        if (Trimmed > logTrimmed) {
+                                SendMessage(hLogPane, EM_SETSEL, 0, (LPARAM)(Trimmed - logTrimmed));
+                                SendMessage(hLogPane, EM_REPLACESEL, FALSE, (LPARAM)"");
+                                logTrimmed = Trimmed;
+                        }
+                        SearchEvict(search, Evicted);
+                }
+
                 int len = GetWindowTextLength(hLogPane);
                 SendMessage(hLogPane, EM_SETSEL, len, len);
                 SendMessage(hLogPane, EM_REPLACESEL, FALSE, (LPARAM)output.c_str());
                 SendMessage(hLogPane, EM_SCROLLCARET, 0, 0);
+                logBatches.push_back({ lines.size(), logTrimmed, Events });
+                logBatches.back().End += SendMessage(hLogPane, EM_GETTEXTLENGTHEX, (WPARAM)&TextLength, 0);
 
                 break;
         }
@@ -827,12 +6378,15 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 {
         INITCOMMONCONTROLSEX iccex;
         WNDCLASSEX wcex;
+        WSADATA wsaData;
         MSG msg;
 
         iccex.dwSize = sizeof(INITCOMMONCONTROLSEX);
         iccex.dwICC = ICC_WIN95_CLASSES;
         InitCommonControlsEx(&iccex);
 
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+
         wcex.cbSize = sizeof(WNDCLASSEX);
         wcex.style = CS_HREDRAW | CS_VREDRAW;
         wcex.lpfnWndProc = WndProc;
@@ -875,6 +6429,8 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
                 DispatchMessage(&msg);
         }
 
+        WSACleanup();
+
         return (int)msg.wParam;
 }
 